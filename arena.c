@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+// arena_block is a chunk of memory allocations are bumped out of. Blocks form a list, newest first
+struct arena_block {
+  arena_block* next;
+  size_t size;
+  size_t used;
+  long double data[]; // long double has the strictest alignment of the basic types
+};
+
+// ARENA_ALIGN is the alignment of every allocation (a power of two, at least that of long double)
+#define ARENA_ALIGN 16
+
+void arena_init(arena* a)
+{
+  a->blocks = NULL;
+}
+
+void* arena_alloc(arena* a, size_t size)
+{
+  size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+  arena_block* block = a->blocks;
+  if (block == NULL || block->size - block->used < size)
+  {
+    size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+    block = (arena_block*)malloc(sizeof(arena_block) + block_size);
+    if (block == NULL)
+    {
+      perror("allocating arena block");
+      return NULL;
+    }
+    block->size = block_size;
+    block->used = 0;
+    // Keep the current block at the head if the new one is a one-off for a large allocation,
+    // so the remainder of the current block can still be used
+    if (a->blocks != NULL && size > ARENA_BLOCK_SIZE)
+    {
+      block->next = a->blocks->next;
+      a->blocks->next = block;
+    } else {
+      block->next = a->blocks;
+      a->blocks = block;
+    }
+  }
+  void* ptr = (char*)block->data + block->used;
+  block->used += size;
+  memset(ptr, 0, size);
+  return ptr;
+}
+
+char* arena_strndup(arena* a, const char* str, size_t n)
+{
+  size_t len = strnlen(str, n);
+  char* copy = (char*)arena_alloc(a, len + 1);
+  if (copy != NULL)
+  {
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+  }
+  return copy;
+}
+
+char* arena_strdup(arena* a, const char* str)
+{
+  return arena_strndup(a, str, strlen(str));
+}
+
+void arena_free(arena* a)
+{
+  arena_block* block = a->blocks;
+  while (block != NULL)
+  {
+    arena_block* next = block->next;
+    free(block);
+    block = next;
+  }
+  a->blocks = NULL;
+}
@@ -0,0 +1,29 @@
+#pragma once
+#include <stddef.h>
+
+// ARENA_BLOCK_SIZE is the size of each block an arena carves allocations out of.
+// Larger allocations get a block of their own
+#define ARENA_BLOCK_SIZE 4096
+
+typedef struct arena_block arena_block;
+
+// arena is a bump allocator: allocations are never freed individually, only all at once with arena_free.
+// This suits per-request objects, which all share the lifetime of the request.
+typedef struct {
+  arena_block* blocks;
+} arena;
+
+// arena_init prepares an empty arena
+void arena_init(arena* a);
+
+// arena_alloc returns size bytes of zeroed memory owned by a, or NULL if out of memory
+void* arena_alloc(arena* a, size_t size);
+
+// arena_strdup copies str into a
+char* arena_strdup(arena* a, const char* str);
+
+// arena_strndup copies at most n bytes of str into a, adding a null terminator
+char* arena_strndup(arena* a, const char* str, size_t n);
+
+// arena_free releases every allocation made from a. The arena may be reused afterwards
+void arena_free(arena* a);
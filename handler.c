@@ -0,0 +1,230 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <time.h>
+#include <poll.h>
+
+#include "request_handler.h"
+#include "handler.h"
+
+/*
+  handler.c implements the protocol-independent part of dynamic handlers: the per-request context, the
+  continuation bookkeeping, and the response API. Drivers for each protocol (handle_conn for HTTP/1.1, the
+  connection loop in http2.c) decide when a yielded handler is resumed, and supply the response_writer.
+*/
+
+handler_ctx* handler_create(handler_fn fn, http_req* req, route_param* params, int num_params, response_writer writer)
+{
+  // The context lives in its own arena: start with one on the stack and move it in
+  arena a;
+  arena_init(&a);
+  handler_ctx* ctx = (handler_ctx*)arena_alloc(&a, sizeof(handler_ctx));
+  http_resp* resp = (http_resp*)arena_alloc(&a, sizeof(http_resp));
+  if (ctx == NULL || resp == NULL)
+  {
+    arena_free(&a);
+    return NULL;
+  }
+  ctx->arena = a;
+  ctx->fn = fn;
+  ctx->req = req;
+  ctx->resp = resp;
+  ctx->writer = writer;
+  ctx->wait = HANDLER_WAIT_NONE;
+  for (int i = 0; i < num_params && i < ROUTE_MAX_PARAMS; ++i)
+  {
+    ctx->params[i].name = params[i].name;
+    ctx->params[i].value = arena_strndup(&ctx->arena, params[i].value, params[i].value_len);
+    ctx->params[i].value_len = params[i].value_len;
+    ++ctx->num_params;
+  }
+  return ctx;
+}
+
+int handler_step(handler_ctx* ctx)
+{
+  ctx->wait = HANDLER_WAIT_NONE;
+  if (ctx->fn(ctx) == HANDLER_YIELD)
+  {
+    return HANDLER_YIELD;
+  }
+  ctx->done = true;
+  if (!ctx->resp_started)
+  {
+    printf("handler completed without a response\n");
+    response_send(ctx, 500, "text/plain", "500 Internal Server Error\n", strlen("500 Internal Server Error\n"));
+  } else if (!ctx->resp_ended) {
+    response_end(ctx);
+  }
+  return HANDLER_DONE;
+}
+
+void handler_destroy(handler_ctx* ctx)
+{
+  if (!ctx->done && ctx->on_cancel != NULL)
+  {
+    ctx->on_cancel(ctx);
+  }
+  // ctx lives in its own arena, so copy the arena out before freeing it
+  arena a = ctx->arena;
+  arena_free(&a);
+}
+
+void handler_on_cancel(handler_ctx* ctx, handler_cancel_fn cancel)
+{
+  ctx->on_cancel = cancel;
+}
+
+bool handler_ready(handler_ctx* ctx, long long now, short revents)
+{
+  switch (ctx->wait)
+  {
+    case HANDLER_WAIT_TIMER:
+      return now >= ctx->wait_deadline;
+    case HANDLER_WAIT_FD:
+      return revents != 0;
+    case HANDLER_WAIT_DRAINED:
+      return ctx->writer.pending(ctx) < HANDLER_OUTPUT_HIGH_WATER;
+    case HANDLER_WAIT_BODY:
+      return false;
+    default:
+      return true;
+  }
+}
+
+long long handler_now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+const char* handler_param(handler_ctx* ctx, const char* name)
+{
+  for (int i = 0; i < ctx->num_params; ++i)
+  {
+    if (strcmp(ctx->params[i].name, name) == 0)
+    {
+      return ctx->params[i].value;
+    }
+  }
+  return NULL;
+}
+
+void* handler_state(handler_ctx* ctx, size_t size)
+{
+  if (ctx->state == NULL)
+  {
+    ctx->state = arena_alloc(&ctx->arena, size);
+  }
+  return ctx->state;
+}
+
+int response_header(handler_ctx* ctx, const char* key, const char* value)
+{
+  if (ctx->resp_started)
+  {
+    printf("response_header called after response_begin\n");
+    return 1;
+  }
+  header_list* header = (header_list*)arena_alloc(&ctx->arena, sizeof(header_list));
+  header_entry* entry = (header_entry*)arena_alloc(&ctx->arena, sizeof(header_entry));
+  if (header == NULL || entry == NULL)
+  {
+    return 1;
+  }
+  entry->key = arena_strdup(&ctx->arena, key);
+  entry->value = arena_strdup(&ctx->arena, value);
+  header->entry = entry;
+  // Append, so headers go out in the order they were added
+  header_list** tail = &ctx->resp->headers;
+  while (*tail != NULL)
+  {
+    tail = &(*tail)->next;
+  }
+  *tail = header;
+  return 0;
+}
+
+int response_begin(handler_ctx* ctx, int status, const char* content_type)
+{
+  if (ctx->resp_started)
+  {
+    return 1;
+  }
+  if (content_type != NULL && response_header(ctx, "Content-Type", content_type) != 0)
+  {
+    return 1;
+  }
+  ctx->resp->status_code = status;
+  ctx->resp->status_text = (char*)status_text(status);
+  ctx->resp_started = true;
+  return ctx->writer.begin(ctx);
+}
+
+int response_write(handler_ctx* ctx, const void* buf, size_t len)
+{
+  if (!ctx->resp_started || ctx->resp_ended)
+  {
+    return 1;
+  }
+  if (len == 0)
+  {
+    return 0;
+  }
+  return ctx->writer.write(ctx, (const char*)buf, len);
+}
+
+int response_printf(handler_ctx* ctx, const char* fmt, ...)
+{
+  char buf[BUF_SIZE];
+  va_list args;
+  va_start(args, fmt);
+  int len = vsnprintf(buf, sizeof(buf), fmt, args);
+  va_end(args);
+  if (len < 0)
+  {
+    return 1;
+  }
+  if ((size_t)len >= sizeof(buf))
+  {
+    // Too big for the stack buffer: format again into the arena
+    char* big = (char*)arena_alloc(&ctx->arena, len + 1);
+    if (big == NULL)
+    {
+      return 1;
+    }
+    va_start(args, fmt);
+    vsnprintf(big, len + 1, fmt, args);
+    va_end(args);
+    return response_write(ctx, big, len);
+  }
+  return response_write(ctx, buf, len);
+}
+
+int response_end(handler_ctx* ctx)
+{
+  if (!ctx->resp_started || ctx->resp_ended)
+  {
+    return 1;
+  }
+  ctx->resp_ended = true;
+  return ctx->writer.end(ctx);
+}
+
+int response_send(handler_ctx* ctx, int status, const char* content_type, const char* body, size_t len)
+{
+  char length[32];
+  snprintf(length, sizeof(length), "%zu", len);
+  if (response_header(ctx, "Content-Length", length) != 0 || response_begin(ctx, status, content_type) != 0)
+  {
+    return 1;
+  }
+  if (response_write(ctx, body, len) != 0)
+  {
+    return 1;
+  }
+  return response_end(ctx);
+}
@@ -0,0 +1,173 @@
+#pragma once
+#include <stddef.h>
+#include <stdbool.h>
+#include <poll.h>
+
+#include "request_handler.h"
+#include "arena.h"
+#include "router.h"
+
+/*
+  Dynamic handlers are C functions serving requests in-process, registered with route_register (see router.h).
+
+  A handler is a stackless continuation: it is called again every time whatever it yielded on is ready, and resumes
+  just after the yield. Local variables do NOT survive a yield, so anything that must is kept in HANDLER_STATE:
+
+    typedef struct { int i; } count_state;
+
+    int count_handler(handler_ctx* ctx)
+    {
+      count_state* st = HANDLER_STATE(ctx, count_state);
+      HANDLER_BEGIN(ctx);
+      response_begin(ctx, 200, "text/plain");
+      for (st->i = 0; st->i < 3; ++st->i)
+      {
+        response_printf(ctx, "%d\n", st->i);
+        HANDLER_SLEEP(ctx, 1000);
+      }
+      response_end(ctx);
+      HANDLER_END(ctx);
+    }
+
+  Each yield macro must be on a line of its own, and handlers must not use `switch` statements spanning a yield.
+  All memory handed out through the context (state, parameters, response headers) is owned by the request's arena
+  and released once the handler completes.
+
+  A request can also be abandoned while its handler is yielded (the client resets the stream or goes away, the body
+  turns out to be malformed, the server shuts down), in which case the handler is never resumed. Anything it holds
+  outside the arena, such as an upstream socket it is waiting on, must be released by a callback registered with
+  handler_on_cancel.
+*/
+
+// Return values of a handler_fn
+#define HANDLER_DONE 0
+#define HANDLER_YIELD 1
+
+// What a yielded handler is waiting on (handler_ctx.wait)
+#define HANDLER_WAIT_NONE 0     // nothing: resume as soon as possible
+#define HANDLER_WAIT_TIMER 1    // wait_deadline (see handler_now_ms) to pass
+#define HANDLER_WAIT_FD 2       // wait_fd to become ready for wait_events (POLLIN/POLLOUT)
+#define HANDLER_WAIT_BODY 3     // the next chunk of the request body
+#define HANDLER_WAIT_DRAINED 4  // buffered response output to drop below HANDLER_OUTPUT_HIGH_WATER
+
+// HANDLER_OUTPUT_HIGH_WATER is the amount of buffered, unsent response output above which HANDLER_AWAIT_DRAINED yields
+#define HANDLER_OUTPUT_HIGH_WATER (64 * 1024)
+
+// response_writer carries a handler's response to the client. Each protocol (HTTP/1.1, HTTP/2) provides one
+typedef struct {
+  int (*begin)(handler_ctx* ctx);                               // send the status line/headers in ctx->resp
+  int (*write)(handler_ctx* ctx, const char* buf, size_t len);  // send (or buffer) part of the body
+  int (*end)(handler_ctx* ctx);                                 // finish the body
+  size_t (*pending)(handler_ctx* ctx);                          // bytes of body buffered but not yet sent
+  void* io;                                                     // protocol-specific connection/stream
+} response_writer;
+
+// handler_cancel_fn releases what a handler abandoned before completing holds outside its arena
+typedef void (*handler_cancel_fn)(handler_ctx* ctx);
+
+// handler_ctx is the (arena-allocated) state of one request being served by a dynamic handler
+struct handler_ctx {
+  arena arena;
+  handler_fn fn;
+  http_req* req;
+  http_resp* resp;
+  route_param params[ROUTE_MAX_PARAMS];
+  int num_params;
+  void* state;
+
+  // Continuation state: where to resume, and what we're waiting on until then
+  int resume_point;
+  int wait;
+  long long wait_deadline;
+  int wait_fd;
+  short wait_events;
+  bool done;                  // fn has returned HANDLER_DONE
+  handler_cancel_fn on_cancel;
+
+  // The current chunk of the request body, valid from HANDLER_AWAIT_BODY until the next yield.
+  // body_done is set (with an empty chunk) once the whole body has been delivered
+  const char* body_chunk;
+  size_t body_chunk_len;
+  bool body_done;
+
+  bool resp_started;
+  bool resp_ended;
+  response_writer writer;
+};
+
+// HANDLER_BEGIN and HANDLER_END bracket the body of a handler
+#define HANDLER_BEGIN(ctx) switch ((ctx)->resume_point) { case 0:
+#define HANDLER_END(ctx) } (ctx)->resume_point = -1; return HANDLER_DONE
+
+// HANDLER_YIELD_ON suspends the handler until the driver finds the wait condition satisfied
+#define HANDLER_YIELD_ON(ctx, wait_on) \
+  do { (ctx)->wait = (wait_on); (ctx)->resume_point = __LINE__; return HANDLER_YIELD; case __LINE__:; } while (0)
+
+// HANDLER_SLEEP suspends the handler for ms milliseconds
+#define HANDLER_SLEEP(ctx, ms) \
+  do { (ctx)->wait_deadline = handler_now_ms() + (ms); HANDLER_YIELD_ON(ctx, HANDLER_WAIT_TIMER); } while (0)
+
+// HANDLER_AWAIT_READABLE and HANDLER_AWAIT_WRITABLE suspend the handler until fd (e.g. a non-blocking
+// upstream socket) can be read from/written to without blocking
+#define HANDLER_AWAIT_READABLE(ctx, fd) \
+  do { (ctx)->wait_fd = (fd); (ctx)->wait_events = POLLIN; HANDLER_YIELD_ON(ctx, HANDLER_WAIT_FD); } while (0)
+#define HANDLER_AWAIT_WRITABLE(ctx, fd) \
+  do { (ctx)->wait_fd = (fd); (ctx)->wait_events = POLLOUT; HANDLER_YIELD_ON(ctx, HANDLER_WAIT_FD); } while (0)
+
+// HANDLER_AWAIT_BODY suspends the handler until the next chunk of the request body (or its end) is available
+// in ctx->body_chunk/body_chunk_len/body_done
+#define HANDLER_AWAIT_BODY(ctx) HANDLER_YIELD_ON(ctx, HANDLER_WAIT_BODY)
+
+// HANDLER_AWAIT_DRAINED suspends the handler while too much of its response is waiting to be sent
+#define HANDLER_AWAIT_DRAINED(ctx) \
+  do { if ((ctx)->writer.pending(ctx) >= HANDLER_OUTPUT_HIGH_WATER) HANDLER_YIELD_ON(ctx, HANDLER_WAIT_DRAINED); } while (0)
+
+// HANDLER_STATE returns the handler's per-request state (zeroed on first use), which survives yields
+#define HANDLER_STATE(ctx, type) ((type*)handler_state((ctx), sizeof(type)))
+
+// handler_create allocates the context for serving req with fn. params (from route_lookup) are copied into the context
+handler_ctx* handler_create(handler_fn fn, http_req* req, route_param* params, int num_params, response_writer writer);
+
+// handler_step runs fn until it yields or completes, returning HANDLER_YIELD or HANDLER_DONE.
+// When fn completes, any response it left unfinished is finished (or replaced with a 500 if it never started one)
+int handler_step(handler_ctx* ctx);
+
+// handler_destroy releases ctx and everything allocated from it. If the handler hasn't completed, its
+// handler_on_cancel callback is run first
+void handler_destroy(handler_ctx* ctx);
+
+// handler_on_cancel registers cancel to be called (with the state still intact) if the request is abandoned before
+// the handler completes. It must not touch the response; once the handler returns HANDLER_DONE it is never called
+void handler_on_cancel(handler_ctx* ctx, handler_cancel_fn cancel);
+
+// handler_ready reports whether the condition a yielded handler is waiting on is satisfied, given the
+// poll() revents for its wait_fd. HANDLER_WAIT_BODY is left to the driver, which owns the request body
+bool handler_ready(handler_ctx* ctx, long long now, short revents);
+
+// handler_now_ms returns the current time in milliseconds, from a monotonic clock
+long long handler_now_ms(void);
+
+// handler_param returns the value captured for the `:name`/`*name` placeholder name, or NULL
+const char* handler_param(handler_ctx* ctx, const char* name);
+
+// handler_state returns size bytes of per-request state, allocated (zeroed) on first use
+void* handler_state(handler_ctx* ctx, size_t size);
+
+// response_header adds a header to the response. It must be called before response_begin
+int response_header(handler_ctx* ctx, const char* key, const char* value);
+
+// response_begin sends the response status and headers. The body is streamed with response_write
+// (using chunked encoding over HTTP/1.1 unless a Content-Length header was added)
+int response_begin(handler_ctx* ctx, int status, const char* content_type);
+
+// response_write sends (or buffers) len bytes of the response body
+int response_write(handler_ctx* ctx, const void* buf, size_t len);
+
+// response_printf formats and writes part of the response body
+int response_printf(handler_ctx* ctx, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+// response_end finishes the response
+int response_end(handler_ctx* ctx);
+
+// response_send sends a complete response with the given body in one go
+int response_send(handler_ctx* ctx, int status, const char* content_type, const char* body, size_t len);
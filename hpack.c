@@ -0,0 +1,585 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+
+#include "request_handler.h"
+#include "hpack.h"
+
+/*
+  hpack.c implements HPACK (RFC 7541), the header compression format used by HTTP/2.
+
+  - Decoding supports every representation: indexed fields, literals (with and without indexing, and never indexed),
+    Huffman-coded strings and dynamic table size updates.
+  - Encoding uses indexed fields where a static or dynamic table entry matches exactly, and otherwise literals
+    (with an indexed name where possible). Strings are never Huffman-coded on the way out: response headers are small,
+    and values worth compressing (e.g. Content-Type) end up in the dynamic table after their first use anyway.
+*/
+
+// HPACK_ENTRY_OVERHEAD is the per-entry overhead counted towards the table size (RFC 7541 section 4.1)
+#define HPACK_ENTRY_OVERHEAD 32
+// HPACK_MAX_STRING caps the length of a single decoded name or value
+#define HPACK_MAX_STRING (64 * 1024)
+
+// STATIC_TABLE is the HPACK static table (RFC 7541, Appendix A)
+static const hpack_field STATIC_TABLE[HPACK_STATIC_ENTRIES] = {
+  { ":authority", "" },
+  { ":method", "GET" },
+  { ":method", "POST" },
+  { ":path", "/" },
+  { ":path", "/index.html" },
+  { ":scheme", "http" },
+  { ":scheme", "https" },
+  { ":status", "200" },
+  { ":status", "204" },
+  { ":status", "206" },
+  { ":status", "304" },
+  { ":status", "400" },
+  { ":status", "404" },
+  { ":status", "500" },
+  { "accept-charset", "" },
+  { "accept-encoding", "gzip, deflate" },
+  { "accept-language", "" },
+  { "accept-ranges", "" },
+  { "accept", "" },
+  { "access-control-allow-origin", "" },
+  { "age", "" },
+  { "allow", "" },
+  { "authorization", "" },
+  { "cache-control", "" },
+  { "content-disposition", "" },
+  { "content-encoding", "" },
+  { "content-language", "" },
+  { "content-length", "" },
+  { "content-location", "" },
+  { "content-range", "" },
+  { "content-type", "" },
+  { "cookie", "" },
+  { "date", "" },
+  { "etag", "" },
+  { "expect", "" },
+  { "expires", "" },
+  { "from", "" },
+  { "host", "" },
+  { "if-match", "" },
+  { "if-modified-since", "" },
+  { "if-none-match", "" },
+  { "if-range", "" },
+  { "if-unmodified-since", "" },
+  { "last-modified", "" },
+  { "link", "" },
+  { "location", "" },
+  { "max-forwards", "" },
+  { "proxy-authenticate", "" },
+  { "proxy-authorization", "" },
+  { "range", "" },
+  { "referer", "" },
+  { "refresh", "" },
+  { "retry-after", "" },
+  { "server", "" },
+  { "set-cookie", "" },
+  { "strict-transport-security", "" },
+  { "transfer-encoding", "" },
+  { "user-agent", "" },
+  { "vary", "" },
+  { "via", "" },
+  { "www-authenticate", "" },
+};
+
+// HUFFMAN_CODES and HUFFMAN_CODE_LEN are the HPACK Huffman code (RFC 7541, Appendix B), right-aligned.
+// Symbol 256 is EOS.
+static const uint32_t HUFFMAN_CODES[257] = {
+  0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+  0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+  0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+  0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+  0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+  0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+  0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+  0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+  0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+  0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+  0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+  0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+  0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+  0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+  0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+  0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+  0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+  0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+  0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+  0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+  0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+  0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+  0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+  0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+  0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+  0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+  0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+  0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+  0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+  0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+  0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+  0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+  0x3fffffff,
+};
+
+static const uint8_t HUFFMAN_CODE_LEN[257] = {
+  13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+  28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+  6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+  5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+  13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+  7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+  15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+  6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+  20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+  24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+  22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+  21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+  26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+  19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+  20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+  26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+  30,
+};
+
+// The Huffman code is decoded by walking a binary tree built from HUFFMAN_CODES on first use.
+// Internal nodes are numbered from 0 (the root); leaves are stored as -(symbol + 1).
+static int16_t huffman_tree[256][2];
+static int huffman_tree_built = 0;
+
+static void build_huffman_tree(void)
+{
+  int next_node = 1;
+  memset(huffman_tree, 0, sizeof(huffman_tree));
+  for (int sym = 0; sym < 257; ++sym)
+  {
+    int node = 0;
+    for (int bit = HUFFMAN_CODE_LEN[sym] - 1; bit >= 0; --bit)
+    {
+      int b = (HUFFMAN_CODES[sym] >> bit) & 1;
+      if (bit == 0)
+      {
+        huffman_tree[node][b] = -(sym + 1);
+      } else {
+        if (huffman_tree[node][b] == 0)
+        {
+          huffman_tree[node][b] = next_node++;
+        }
+        node = huffman_tree[node][b];
+      }
+    }
+  }
+  huffman_tree_built = 1;
+}
+
+// huffman_decode decodes len bytes of Huffman-coded src into a newly allocated, null-terminated string
+static char* huffman_decode(const uint8_t* src, size_t len)
+{
+  if (!huffman_tree_built)
+  {
+    build_huffman_tree();
+  }
+  // The shortest code is 5 bits, so the output is at most 8/5 of the input
+  char* out = (char*)malloc(len * 8 / 5 + 2);
+  if (out == NULL)
+  {
+    return NULL;
+  }
+  size_t out_len = 0;
+  int node = 0;
+  int depth = 0;      // bits consumed since the last complete symbol
+  int all_ones = 1;   // whether those bits were all 1 (valid padding is a prefix of EOS)
+  for (size_t i = 0; i < len; ++i)
+  {
+    for (int bit = 7; bit >= 0; --bit)
+    {
+      int b = (src[i] >> bit) & 1;
+      int child = huffman_tree[node][b];
+      all_ones &= b;
+      ++depth;
+      if (child < 0)
+      {
+        int sym = -child - 1;
+        if (sym == 256)
+        {
+          // EOS must not appear in the string itself
+          free(out);
+          return NULL;
+        }
+        out[out_len++] = (char)sym;
+        node = 0;
+        depth = 0;
+        all_ones = 1;
+      } else {
+        node = child;
+      }
+    }
+  }
+  if (depth > 7 || !all_ones)
+  {
+    free(out);
+    return NULL;
+  }
+  out[out_len] = '\0';
+  return out;
+}
+
+// decode_int decodes an integer with an n-bit prefix (RFC 7541 section 5.1) starting at *pos
+static int decode_int(const uint8_t* buf, size_t len, size_t* pos, int n, uint32_t* value)
+{
+  if (*pos >= len)
+  {
+    return -1;
+  }
+  uint32_t max_prefix = (1u << n) - 1;
+  uint32_t v = buf[(*pos)++] & max_prefix;
+  if (v < max_prefix)
+  {
+    *value = v;
+    return 0;
+  }
+  int shift = 0;
+  while (1)
+  {
+    if (*pos >= len || shift > 28)
+    {
+      return -1;
+    }
+    uint8_t b = buf[(*pos)++];
+    v += (uint32_t)(b & 0x7f) << shift;
+    shift += 7;
+    if ((b & 0x80) == 0)
+    {
+      break;
+    }
+  }
+  *value = v;
+  return 0;
+}
+
+// decode_string decodes a (possibly Huffman-coded) string literal starting at *pos into a newly allocated string
+static char* decode_string(const uint8_t* buf, size_t len, size_t* pos)
+{
+  if (*pos >= len)
+  {
+    return NULL;
+  }
+  int huffman = buf[*pos] & 0x80;
+  uint32_t str_len;
+  if (decode_int(buf, len, pos, 7, &str_len) == -1 || str_len > HPACK_MAX_STRING || str_len > len - *pos)
+  {
+    return NULL;
+  }
+  char* str;
+  if (huffman)
+  {
+    str = huffman_decode(buf + *pos, str_len);
+  } else {
+    str = (char*)malloc(str_len + 1);
+    if (str != NULL)
+    {
+      memcpy(str, buf + *pos, str_len);
+      str[str_len] = '\0';
+    }
+  }
+  *pos += str_len;
+  return str;
+}
+
+int hpack_table_init(hpack_table* table, size_t max_size)
+{
+  memset(table, 0, sizeof(hpack_table));
+  table->capacity = max_size / HPACK_ENTRY_OVERHEAD + 1;
+  table->entries = (hpack_field*)calloc(table->capacity, sizeof(hpack_field));
+  if (table->entries == NULL)
+  {
+    perror("allocating hpack table");
+    return -1;
+  }
+  table->max_size = max_size;
+  table->limit = max_size;
+  return 0;
+}
+
+void hpack_table_free(hpack_table* table)
+{
+  for (size_t i = 0; i < table->count; ++i)
+  {
+    hpack_field* f = &table->entries[(table->head + i) % table->capacity];
+    free(f->name);
+    free(f->value);
+  }
+  free(table->entries);
+  table->entries = NULL;
+  table->count = 0;
+  table->size = 0;
+}
+
+static size_t entry_size(const char* name, const char* value)
+{
+  return strlen(name) + strlen(value) + HPACK_ENTRY_OVERHEAD;
+}
+
+// evict_until removes the oldest entries until the table size is at most max_size
+static void evict_until(hpack_table* table, size_t max_size)
+{
+  while (table->count > 0 && table->size > max_size)
+  {
+    hpack_field* oldest = &table->entries[(table->head + table->count - 1) % table->capacity];
+    table->size -= entry_size(oldest->name, oldest->value);
+    free(oldest->name);
+    free(oldest->value);
+    oldest->name = NULL;
+    oldest->value = NULL;
+    --table->count;
+  }
+}
+
+int hpack_table_resize(hpack_table* table, size_t max_size)
+{
+  if (max_size > table->limit)
+  {
+    return -1;
+  }
+  evict_until(table, max_size);
+  table->max_size = max_size;
+  table->pending_update = 1;
+  return 0;
+}
+
+// table_add inserts a copy of name: value as the newest entry, taking ownership of neither argument
+static void table_add(hpack_table* table, const char* name, const char* value)
+{
+  size_t size = entry_size(name, value);
+  if (size > table->max_size)
+  {
+    // An entry larger than the table empties it and is not added (RFC 7541 section 4.4)
+    evict_until(table, 0);
+    return;
+  }
+  evict_until(table, table->max_size - size);
+  table->head = (table->head + table->capacity - 1) % table->capacity;
+  table->entries[table->head].name = strdup(name);
+  table->entries[table->head].value = strdup(value);
+  table->size += size;
+  ++table->count;
+}
+
+// table_get returns the field at (1-based) index in the combined static + dynamic index space, or NULL
+static hpack_field* table_get(hpack_table* table, uint32_t index)
+{
+  if (index == 0)
+  {
+    return NULL;
+  }
+  if (index <= HPACK_STATIC_ENTRIES)
+  {
+    return (hpack_field*)&STATIC_TABLE[index - 1];
+  }
+  index -= HPACK_STATIC_ENTRIES + 1;
+  if (index >= table->count)
+  {
+    return NULL;
+  }
+  return &table->entries[(table->head + index) % table->capacity];
+}
+
+// append_header appends name: value (taking ownership of both) to the end of *headers
+static int append_header(header_list** headers, char* name, char* value)
+{
+  header_list* node = (header_list*)malloc(sizeof(header_list));
+  header_entry* entry = (header_entry*)malloc(sizeof(header_entry));
+  if (node == NULL || entry == NULL)
+  {
+    perror("allocating decoded header");
+    free(node);
+    free(entry);
+    return -1;
+  }
+  entry->key = name;
+  entry->value = value;
+  node->entry = entry;
+  node->next = NULL;
+  while (*headers != NULL)
+  {
+    headers = &(*headers)->next;
+  }
+  *headers = node;
+  return 0;
+}
+
+int hpack_decode(hpack_table* table, const uint8_t* block, size_t len, header_list** headers)
+{
+  size_t pos = 0;
+  int fields_seen = 0;
+  while (pos < len)
+  {
+    uint8_t b = block[pos];
+    uint32_t index;
+    if (b & 0x80)
+    {
+      // Indexed header field
+      if (decode_int(block, len, &pos, 7, &index) == -1)
+      {
+        return -1;
+      }
+      hpack_field* f = table_get(table, index);
+      if (f == NULL || append_header(headers, strdup(f->name), strdup(f->value)) == -1)
+      {
+        return -1;
+      }
+      ++fields_seen;
+      continue;
+    }
+    if ((b & 0xe0) == 0x20)
+    {
+      // Dynamic table size update: only allowed before the first field of a block
+      if (fields_seen > 0 || decode_int(block, len, &pos, 5, &index) == -1 || hpack_table_resize(table, index) == -1)
+      {
+        return -1;
+      }
+      continue;
+    }
+
+    // Literal header field: with incremental indexing (01), without indexing (0000) or never indexed (0001)
+    int indexing = (b & 0xc0) == 0x40;
+    if (decode_int(block, len, &pos, indexing ? 6 : 4, &index) == -1)
+    {
+      return -1;
+    }
+    char* name;
+    if (index == 0)
+    {
+      name = decode_string(block, len, &pos);
+    } else {
+      hpack_field* f = table_get(table, index);
+      name = f == NULL ? NULL : strdup(f->name);
+    }
+    if (name == NULL)
+    {
+      return -1;
+    }
+    char* value = decode_string(block, len, &pos);
+    if (value == NULL)
+    {
+      free(name);
+      return -1;
+    }
+    if (indexing)
+    {
+      table_add(table, name, value);
+    }
+    if (append_header(headers, name, value) == -1)
+    {
+      return -1;
+    }
+    ++fields_seen;
+  }
+  return 0;
+}
+
+// encode_int writes value with an n-bit prefix, OR-ing flags into the first byte
+static int encode_int(uint8_t* out, size_t cap, uint8_t flags, int n, uint32_t value)
+{
+  uint32_t max_prefix = (1u << n) - 1;
+  size_t pos = 0;
+  if (cap == 0)
+  {
+    return -1;
+  }
+  if (value < max_prefix)
+  {
+    out[pos++] = flags | value;
+    return pos;
+  }
+  out[pos++] = flags | max_prefix;
+  value -= max_prefix;
+  while (value >= 0x80)
+  {
+    if (pos >= cap)
+    {
+      return -1;
+    }
+    out[pos++] = (value & 0x7f) | 0x80;
+    value >>= 7;
+  }
+  if (pos >= cap)
+  {
+    return -1;
+  }
+  out[pos++] = value;
+  return pos;
+}
+
+// encode_string writes str as a raw (non-Huffman) string literal
+static int encode_string(uint8_t* out, size_t cap, const char* str)
+{
+  size_t len = strlen(str);
+  int n = encode_int(out, cap, 0, 7, len);
+  if (n == -1 || n + len > cap)
+  {
+    return -1;
+  }
+  memcpy(out + n, str, len);
+  return n + len;
+}
+
+int hpack_begin_block(hpack_table* table, uint8_t* out, size_t cap)
+{
+  if (!table->pending_update)
+  {
+    return 0;
+  }
+  table->pending_update = 0;
+  return encode_int(out, cap, 0x20, 5, table->max_size);
+}
+
+int hpack_encode(hpack_table* table, uint8_t* out, size_t cap, const char* name, const char* value, int add_to_table)
+{
+  // Look for an exact match first, remembering the first entry with a matching name
+  uint32_t name_index = 0;
+  for (uint32_t i = 1; i <= HPACK_STATIC_ENTRIES + table->count; ++i)
+  {
+    hpack_field* f = table_get(table, i);
+    if (strcasecmp(f->name, name) != 0)
+    {
+      continue;
+    }
+    if (strcmp(f->value, value) == 0)
+    {
+      return encode_int(out, cap, 0x80, 7, i);
+    }
+    if (name_index == 0)
+    {
+      name_index = i;
+    }
+  }
+
+  int n = add_to_table ? encode_int(out, cap, 0x40, 6, name_index) : encode_int(out, cap, 0x00, 4, name_index);
+  if (n == -1)
+  {
+    return -1;
+  }
+  int m;
+  if (name_index == 0)
+  {
+    if ((m = encode_string(out + n, cap - n, name)) == -1)
+    {
+      return -1;
+    }
+    n += m;
+  }
+  if ((m = encode_string(out + n, cap - n, value)) == -1)
+  {
+    return -1;
+  }
+  n += m;
+  if (add_to_table)
+  {
+    table_add(table, name, value);
+  }
+  return n;
+}
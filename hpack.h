@@ -0,0 +1,53 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+#include "request_handler.h"
+
+// HPACK_STATIC_ENTRIES is the number of entries in the HPACK static table (RFC 7541, Appendix A)
+#define HPACK_STATIC_ENTRIES 61
+// HPACK_DEFAULT_TABLE_SIZE is the default (and our advertised) SETTINGS_HEADER_TABLE_SIZE
+#define HPACK_DEFAULT_TABLE_SIZE 4096
+
+// hpack_field is a single name/value pair in a static or dynamic table
+typedef struct {
+  char* name;
+  char* value;
+} hpack_field;
+
+// hpack_table is the dynamic table for one direction of an HTTP/2 connection.
+// Entries are kept in a ring buffer, newest first, and evicted oldest first.
+typedef struct {
+  hpack_field* entries;
+  size_t capacity;     // number of slots in entries
+  size_t head;         // slot of the newest entry
+  size_t count;        // number of entries in use
+  size_t size;         // sum of entry sizes as defined in RFC 7541 section 4.1
+  size_t max_size;     // current maximum size
+  size_t limit;        // maximum size the table may ever be resized to
+  int pending_update;  // (encoder only) a size update must be emitted at the start of the next block
+} hpack_table;
+
+// hpack_table_init initializes table with a maximum size (and hard limit) of max_size bytes
+int hpack_table_init(hpack_table* table, size_t max_size);
+
+// hpack_table_free releases all entries held by table
+void hpack_table_free(hpack_table* table);
+
+// hpack_table_resize changes the maximum size of table, evicting entries as necessary.
+// For an encoder's table, a dynamic table size update is emitted with the next header block.
+int hpack_table_resize(hpack_table* table, size_t max_size);
+
+// hpack_decode decodes a complete header block, appending the decoded fields (pseudo-headers included)
+// to *headers in the order they appear. Returns 0 on success or -1 on a compression error,
+// after which the connection must be torn down.
+int hpack_decode(hpack_table* table, const uint8_t* block, size_t len, header_list** headers);
+
+// hpack_begin_block must be called before encoding the first field of a header block. It writes any
+// pending dynamic table size update into out, returning the number of bytes written (or -1 if out is too small).
+int hpack_begin_block(hpack_table* table, uint8_t* out, size_t cap);
+
+// hpack_encode writes the representation of name: value into out, returning the number of bytes written
+// (or -1 if out is too small). Fields matching a table entry are sent as an index. Otherwise, if add_to_table is set,
+// the field is sent as a literal and added to the dynamic table, so later blocks on the connection can refer to it.
+int hpack_encode(hpack_table* table, uint8_t* out, size_t cap, const char* name, const char* value, int add_to_table);
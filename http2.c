@@ -0,0 +1,1571 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <ctype.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "request_handler.h"
+#include "hpack.h"
+#include "http2.h"
+#include "upgrade.h"
+#include "handler.h"
+#include "router.h"
+
+/*
+  http2.c implements the server side of HTTP/2 (RFC 7540) over cleartext TCP ("h2c").
+
+  A connection is started either with prior knowledge (the client opens with the HTTP/2 preface) or by upgrading
+  an HTTP/1.1 request carrying `Upgrade: h2c`. As with HTTP/1.1, each connection is served by its own forked
+  process. Within that process a single loop:
+  - reads frames, decoding header blocks with HPACK, and turns each complete request into an http_req
+  - resolves requests with the same prepare_response used for HTTP/1.1, sending the response headers immediately
+  - runs the dynamic handlers (see handler.h) of requests matching a route, resuming each whenever what it yielded on
+    (a timer, a descriptor, the next DATA frame of the request, room in its output buffer) is ready. Handlers of
+    all streams are multiplexed in this one loop, so a handler sleeping or waiting on an upstream holds up nothing else
+  - interleaves the response bodies of all open streams as DATA frames, respecting the connection and per-stream
+    flow-control windows. The next frame always goes to the stream with the smallest virtual time among those
+    whose ancestors (in the priority tree) can't currently send; a stream's virtual time advances by
+    bytes sent / weight, so sibling streams share bandwidth in proportion to their weights.
+
+  There is no TLS support in this server, so h2 (HTTP/2 over TLS, negotiated with ALPN) is not offered.
+*/
+
+// Frame types (RFC 7540 section 6)
+#define H2_DATA 0x0
+#define H2_HEADERS 0x1
+#define H2_PRIORITY 0x2
+#define H2_RST_STREAM 0x3
+#define H2_SETTINGS 0x4
+#define H2_PUSH_PROMISE 0x5
+#define H2_PING 0x6
+#define H2_GOAWAY 0x7
+#define H2_WINDOW_UPDATE 0x8
+#define H2_CONTINUATION 0x9
+
+// Frame flags
+#define H2_FLAG_END_STREAM 0x1
+#define H2_FLAG_ACK 0x1
+#define H2_FLAG_END_HEADERS 0x4
+#define H2_FLAG_PADDED 0x8
+#define H2_FLAG_PRIORITY 0x20
+
+// Error codes (RFC 7540 section 7)
+#define H2_NO_ERROR 0x0
+#define H2_PROTOCOL_ERROR 0x1
+#define H2_INTERNAL_ERROR 0x2
+#define H2_FLOW_CONTROL_ERROR 0x3
+#define H2_STREAM_CLOSED 0x5
+#define H2_FRAME_SIZE_ERROR 0x6
+#define H2_REFUSED_STREAM 0x7
+#define H2_COMPRESSION_ERROR 0x9
+#define H2_ENHANCE_YOUR_CALM 0xb
+
+// Settings identifiers (RFC 7540 section 6.5.2)
+#define H2_SETTINGS_HEADER_TABLE_SIZE 0x1
+#define H2_SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define H2_SETTINGS_INITIAL_WINDOW_SIZE 0x4
+#define H2_SETTINGS_MAX_FRAME_SIZE 0x5
+
+#define H2_FRAME_HEADER_LEN 9
+#define H2_DEFAULT_WINDOW 65535
+#define H2_MAX_WINDOW 0x7fffffff
+#define H2_DEFAULT_FRAME_SIZE 16384
+#define H2_MAX_FRAME_SIZE 16777215
+#define H2_MAX_CONCURRENT_STREAMS 100
+#define H2_DEFAULT_WEIGHT 16
+#define H2_MAX_HEADER_BLOCK (64 * 1024)
+#define H2_IDLE_TIMEOUT_MS (120 * 1000)
+#define H2_LINGER_MS 1000
+#define H2_MAX_RESPONSE_HEADERS 4096
+
+typedef struct h2_stream h2_stream;
+typedef struct h2_conn h2_conn;
+
+// h2_stream tracks a single request/response exchange on an HTTP/2 connection
+struct h2_stream {
+  uint32_t id;
+  bool remote_closed;    // the client has sent END_STREAM
+  bool dispatched;       // the response headers have been sent
+  bool local_closed;     // we have sent END_STREAM
+  int64_t send_window;
+  uint32_t depends_on;   // parent in the priority tree (0 is the root)
+  int weight;            // 1-256
+  uint64_t pass;         // virtual time used to share bandwidth between streams by weight
+  http_req req;
+  size_t req_body_len;
+  http_resp resp;
+  const char* mem_body;  // in-memory body (e.g. the 404 page), sent instead of resp.body_fd
+  size_t body_remaining;
+
+  // Streams served by a dynamic handler. The response body is produced into out and sent from there; the request
+  // body is buffered in (up to one stream window) until the handler takes it
+  h2_conn* conn;
+  handler_ctx* handler;  // NULL once the handler has completed
+  bool streaming;        // the response body comes from out, rather than mem_body/resp.body_fd
+  bool body_ended;       // the handler has finished the response body
+  char* out;              // unsent output is out[out_pos, out_len)
+  size_t out_len;
+  size_t out_pos;
+  size_t out_cap;
+  char* in;
+  size_t in_len;
+  short revents;         // poll() result for the descriptor the handler is waiting on
+  long long linger_deadline; // when to stop waiting for the rest of a request body nobody will read (0: not lingering)
+  bool reset;            // the response headers couldn't be sent and the stream was reset; it is closed once the handler yields
+
+  h2_stream* next;
+};
+
+// h2_conn holds the state of one HTTP/2 connection
+struct h2_conn {
+  int sock;
+  hpack_table decoder;
+  hpack_table encoder;
+  int64_t send_window;
+  uint32_t peer_initial_window;
+  uint32_t peer_max_frame;
+  uint32_t last_stream_id;    // highest stream id opened by the client
+  int num_streams;
+  h2_stream* streams;
+  uint64_t vtime;             // virtual time of the most recently scheduled stream
+
+  // The header block being assembled from a HEADERS frame and its CONTINUATION frames
+  uint8_t* hblock;
+  size_t hblock_len;
+  uint32_t hblock_stream;     // 0 when no header block is in progress
+  bool hblock_end_stream;
+  bool hblock_has_priority;
+  uint32_t hblock_depends_on;
+  int hblock_weight;
+  bool hblock_exclusive;
+
+  bool preface_seen;
+  bool goaway_sent;
+  bool goaway_received;
+  uint8_t rbuf[H2_FRAME_HEADER_LEN + H2_DEFAULT_FRAME_SIZE];
+  size_t rlen;
+  uint8_t wbuf[H2_FRAME_HEADER_LEN + H2_DEFAULT_FRAME_SIZE];
+};
+
+int is_http2_preface(const char* buf, size_t len)
+{
+  if (len == 0)
+  {
+    return 0;
+  }
+  return memcmp(buf, H2_PREFACE, len < H2_PREFACE_LEN ? len : H2_PREFACE_LEN) == 0;
+}
+
+static uint32_t get32(const uint8_t* p)
+{
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void put32(uint8_t* p, uint32_t v)
+{
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+// write_all writes all len bytes of buf to sock, retrying on partial writes
+static int write_all(int sock, const uint8_t* buf, size_t len)
+{
+  while (len > 0)
+  {
+    ssize_t n = write(sock, buf, len);
+    if (n == -1)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      perror("error writing HTTP/2 frame");
+      return -1;
+    }
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// send_frame writes a single frame. The header and payload are written in one go (payload may already
+// live in c->wbuf, just after the space reserved for the header) so the frame isn't split across packets
+static int send_frame(h2_conn* c, uint8_t type, uint8_t flags, uint32_t stream_id, const uint8_t* payload, size_t len)
+{
+  uint8_t* frame = c->wbuf;
+  frame[0] = len >> 16;
+  frame[1] = len >> 8;
+  frame[2] = len;
+  frame[3] = type;
+  frame[4] = flags;
+  put32(frame + 5, stream_id & 0x7fffffff);
+  if (len > 0 && payload != frame + H2_FRAME_HEADER_LEN)
+  {
+    memmove(frame + H2_FRAME_HEADER_LEN, payload, len);
+  }
+  return write_all(c->sock, frame, H2_FRAME_HEADER_LEN + len);
+}
+
+static int send_settings(h2_conn* c)
+{
+  uint8_t payload[12];
+  payload[0] = 0;
+  payload[1] = H2_SETTINGS_MAX_CONCURRENT_STREAMS;
+  put32(payload + 2, H2_MAX_CONCURRENT_STREAMS);
+  payload[6] = 0;
+  payload[7] = H2_SETTINGS_HEADER_TABLE_SIZE;
+  put32(payload + 8, HPACK_DEFAULT_TABLE_SIZE);
+  return send_frame(c, H2_SETTINGS, 0, 0, payload, sizeof(payload));
+}
+
+static int send_window_update(h2_conn* c, uint32_t stream_id, uint32_t increment)
+{
+  uint8_t payload[4];
+  put32(payload, increment);
+  return send_frame(c, H2_WINDOW_UPDATE, 0, stream_id, payload, sizeof(payload));
+}
+
+static int send_rst_stream(h2_conn* c, uint32_t stream_id, uint32_t error_code)
+{
+  uint8_t payload[4];
+  put32(payload, error_code);
+  return send_frame(c, H2_RST_STREAM, 0, stream_id, payload, sizeof(payload));
+}
+
+static int send_goaway(h2_conn* c, uint32_t error_code)
+{
+  uint8_t payload[8];
+  put32(payload, c->last_stream_id);
+  put32(payload + 4, error_code);
+  c->goaway_sent = true;
+  return send_frame(c, H2_GOAWAY, 0, 0, payload, sizeof(payload));
+}
+
+// connection_error reports a connection error to the client. The caller should tear the connection down
+static int connection_error(h2_conn* c, uint32_t error_code)
+{
+  printf("HTTP/2 connection error 0x%x, closing connection\n", error_code);
+  send_goaway(c, error_code);
+  return -1;
+}
+
+static h2_stream* find_stream(h2_conn* c, uint32_t id)
+{
+  for (h2_stream* s = c->streams; s != NULL; s = s->next)
+  {
+    if (s->id == id)
+    {
+      return s;
+    }
+  }
+  return NULL;
+}
+
+static h2_stream* open_stream(h2_conn* c, uint32_t id)
+{
+  h2_stream* s = (h2_stream*)calloc(1, sizeof(h2_stream));
+  if (s == NULL)
+  {
+    perror("allocating HTTP/2 stream");
+    return NULL;
+  }
+  s->id = id;
+  s->conn = c;
+  s->send_window = c->peer_initial_window;
+  s->weight = H2_DEFAULT_WEIGHT;
+  s->next = c->streams;
+  c->streams = s;
+  ++c->num_streams;
+  return s;
+}
+
+// free_header_list frees the nodes of headers, and (if free_strings is set) their keys and values
+static void free_header_list(header_list* headers, bool free_strings)
+{
+  while (headers != NULL)
+  {
+    header_list* next = headers->next;
+    if (free_strings)
+    {
+      free(headers->entry->key);
+      free(headers->entry->value);
+    }
+    free(headers->entry);
+    free(headers);
+    headers = next;
+  }
+}
+
+// close_stream releases s. Streams that depended on s now depend on its parent (RFC 7540 section 5.3.4)
+static void close_stream(h2_conn* c, h2_stream* s)
+{
+  h2_stream** link = &c->streams;
+  while (*link != NULL)
+  {
+    h2_stream* t = *link;
+    if (t == s)
+    {
+      *link = t->next;
+      continue;
+    }
+    if (t->depends_on == s->id)
+    {
+      t->depends_on = s->depends_on;
+    }
+    link = &t->next;
+  }
+  --c->num_streams;
+
+  if (s->handler != NULL)
+  {
+    // The client reset the stream (or the connection is going away) while the handler was still running
+    handler_destroy(s->handler);
+  }
+  free(s->in);
+  free(s->out);
+  if (s->resp.body_fd != NULL)
+  {
+    fclose(s->resp.body_fd);
+  }
+  // Response header values are owned by prepare_response (some are string literals), so only the nodes are freed
+  free_header_list(s->resp.headers, false);
+  free_header_list(s->req.headers, true);
+  free(s->req.verb);
+  free(s->req.path);
+  free(s->req.version);
+  free(s->req.body);
+  free(s);
+}
+
+// is_ancestor reports whether stream ancestor is an ancestor of stream id in the priority tree
+static bool is_ancestor(h2_conn* c, uint32_t ancestor, uint32_t id)
+{
+  h2_stream* s = find_stream(c, id);
+  for (int depth = 0; s != NULL && depth <= c->num_streams; ++depth)
+  {
+    if (s->depends_on == ancestor)
+    {
+      return true;
+    }
+    s = find_stream(c, s->depends_on);
+  }
+  return false;
+}
+
+// set_priority places s in the priority tree (RFC 7540 section 5.3)
+static void set_priority(h2_conn* c, h2_stream* s, uint32_t depends_on, int weight, bool exclusive)
+{
+  if (depends_on == s->id)
+  {
+    // A stream can't depend on itself; keep its current position
+    return;
+  }
+  // If the new parent currently depends on s, it first moves up to take s's place
+  if (depends_on != 0 && is_ancestor(c, s->id, depends_on))
+  {
+    find_stream(c, depends_on)->depends_on = s->depends_on;
+  }
+  if (exclusive)
+  {
+    for (h2_stream* t = c->streams; t != NULL; t = t->next)
+    {
+      if (t != s && t->depends_on == depends_on)
+      {
+        t->depends_on = s->id;
+      }
+    }
+  }
+  s->depends_on = depends_on;
+  s->weight = weight;
+}
+
+// encode_field appends name: value to the header block in block, which already holds *n bytes.
+// Returns -1 if it doesn't fit, in which case the block (and the HPACK table) is left as it was
+static int encode_field(h2_conn* c, uint8_t* block, size_t cap, int* n, const char* name, const char* value, int add_to_table)
+{
+  int m = hpack_encode(&c->encoder, block + *n, cap - *n, name, value, add_to_table);
+  if (m == -1)
+  {
+    return -1;
+  }
+  *n += m;
+  return 0;
+}
+
+// abort_headers gives up on a response on stream s whose header block couldn't be encoded, resetting the stream.
+// Fields already encoded may have entered our HPACK dynamic table, so the n bytes of complete fields are still
+// sent, keeping the client's decoder in sync
+static int abort_headers(h2_conn* c, h2_stream* s, uint8_t* block, int n)
+{
+  printf("HTTP/2 response headers for stream %u could not be encoded, resetting stream\n", s->id);
+  if (send_frame(c, H2_HEADERS, H2_FLAG_END_HEADERS, s->id, block, n) == -1)
+  {
+    return -1;
+  }
+  return send_rst_stream(c, s->id, H2_INTERNAL_ERROR);
+}
+
+// encode_header_list appends the (lowercased, as HTTP/2 requires) headers to the header block in block, which
+// already holds n bytes. Headers that don't fit are dropped. Returns the new length of the block
+static int encode_header_list(h2_conn* c, uint8_t* block, size_t cap, int n, header_list* headers)
+{
+  for (header_list* h = headers; h != NULL; h = h->next)
+  {
+    // A name this long could never fit in a header block; truncating it would send a different header
+    char name[H2_MAX_RESPONSE_HEADERS];
+    size_t len = strlen(h->entry->key);
+    if (len >= sizeof(name))
+    {
+      printf("HTTP/2 response header name of %zu bytes is too long, dropping it\n", len);
+      continue;
+    }
+    for (size_t i = 0; i <= len; ++i)
+    {
+      name[i] = tolower((unsigned char)h->entry->key[i]);
+    }
+    // Values that recur across responses (e.g. Content-Type) go in the dynamic table; lengths rarely do
+    bool add_to_table = strcmp(name, "content-length") != 0;
+    int m = hpack_encode(&c->encoder, block + n, cap - n, name, h->entry->value, add_to_table);
+    if (m == -1)
+    {
+      printf("HTTP/2 response header %s does not fit in the header block, dropping it\n", name);
+      continue;
+    }
+    n += m;
+  }
+  return n;
+}
+
+// dispatch resolves the (complete) request on stream s and sends the response headers.
+// The body, if any, is sent later by the scheduler
+static int dispatch(h2_conn* c, h2_stream* s)
+{
+  if (s->req.body == NULL)
+  {
+    s->req.body = strdup(" <EMPTY REQUEST BODY>");
+  }
+  printf("> REQUEST (HTTP/2 stream %u):\n>\t%s %s %s\n", s->id, s->req.verb, s->req.path, s->req.version);
+  print_headers(s->req.headers, ">\t");
+  printf(">\n");
+  printf(">%s\n\n", s->req.body);
+
+  // A path served by dynamic handlers, but not for this method
+  handler_fn fn;
+  route_param params[ROUTE_MAX_PARAMS];
+  int num_params;
+  const char* allow = NULL;
+  int status = route_lookup(s->req.verb, s->req.path, &fn, params, &num_params, &allow) == 405 ? 405 : prepare_response(&s->req, &s->resp);
+  char status_str[4];
+  uint8_t block[1024];
+  int n = hpack_begin_block(&c->encoder, block, sizeof(block));
+  bool encoded = n != -1;
+  n = encoded ? n : 0;
+  if (status == 0)
+  {
+    snprintf(status_str, sizeof(status_str), "%d", s->resp.status_code);
+    encoded = encoded && encode_field(c, block, sizeof(block), &n, ":status", status_str, 0) == 0;
+    n = encoded ? encode_header_list(c, block, sizeof(block), n, s->resp.headers) : n;
+    for (header_list* h = s->resp.headers; h != NULL; h = h->next)
+    {
+      if (strcasecmp(h->entry->key, "Content-Length") == 0)
+      {
+        s->body_remaining = strtoul(h->entry->value, NULL, 10);
+      }
+    }
+  } else if (status == 404) {
+    char length[16];
+    snprintf(length, sizeof(length), "%zu", strlen(NOT_FOUND_PAGE));
+    encoded = encoded && encode_field(c, block, sizeof(block), &n, ":status", "404", 0) == 0 &&
+              encode_field(c, block, sizeof(block), &n, "content-type", "text/html", 1) == 0 &&
+              encode_field(c, block, sizeof(block), &n, "content-length", length, 0) == 0;
+    s->mem_body = NOT_FOUND_PAGE;
+    s->body_remaining = strlen(NOT_FOUND_PAGE);
+  } else if (status == 405 && allow != NULL) {
+    encoded = encoded && encode_field(c, block, sizeof(block), &n, ":status", "405", 0) == 0 &&
+              encode_field(c, block, sizeof(block), &n, "allow", allow, 0) == 0;
+  } else {
+    snprintf(status_str, sizeof(status_str), "%d", status);
+    encoded = encoded && encode_field(c, block, sizeof(block), &n, ":status", status_str, 0) == 0;
+  }
+  if (!encoded)
+  {
+    int result = abort_headers(c, s, block, n);
+    close_stream(c, s);
+    return result;
+  }
+
+  printf("< RESPONSE (HTTP/2 stream %u):\n<\t:status: %d\n", s->id, status == 0 ? s->resp.status_code : status);
+  if (status == 0)
+  {
+    print_headers(s->resp.headers, "<\t");
+  }
+
+  uint8_t flags = H2_FLAG_END_HEADERS;
+  if (s->body_remaining == 0)
+  {
+    flags |= H2_FLAG_END_STREAM;
+    s->local_closed = true;
+  }
+  if (send_frame(c, H2_HEADERS, flags, s->id, block, n) == -1)
+  {
+    return -1;
+  }
+  s->dispatched = true;
+  // Start the stream at the current virtual time so it neither starves nor is starved by streams already sending
+  s->pass = c->vtime;
+  if (s->local_closed)
+  {
+    close_stream(c, s);
+  }
+  return 0;
+}
+
+// h2_begin, h2_write, h2_end and h2_pending make up the response_writer of a handler serving an HTTP/2 stream.
+// Headers go out right away; the body is buffered in the stream and sent by the scheduler like any other
+static int h2_begin(handler_ctx* ctx)
+{
+  h2_stream* s = (h2_stream*)ctx->writer.io;
+  h2_conn* c = s->conn;
+  char status_str[4];
+  snprintf(status_str, sizeof(status_str), "%d", ctx->resp->status_code);
+  uint8_t block[H2_MAX_RESPONSE_HEADERS];
+  int n = hpack_begin_block(&c->encoder, block, sizeof(block));
+  if (n == -1 || encode_field(c, block, sizeof(block), &n, ":status", status_str, 0) == -1)
+  {
+    // The stream can't be closed from inside the handler: run_handlers does that once it yields
+    abort_headers(c, s, block, n == -1 ? 0 : n);
+    s->reset = true;
+    return 1;
+  }
+  n = encode_header_list(c, block, sizeof(block), n, ctx->resp->headers);
+
+  printf("< RESPONSE (HTTP/2 stream %u, handler):\n<\t:status: %d\n", s->id, ctx->resp->status_code);
+  print_headers(ctx->resp->headers, "<\t");
+  if (send_frame(c, H2_HEADERS, H2_FLAG_END_HEADERS, s->id, block, n) == -1)
+  {
+    return 1;
+  }
+  s->dispatched = true;
+  s->pass = c->vtime;
+  return 0;
+}
+
+static int h2_write(handler_ctx* ctx, const char* buf, size_t len)
+{
+  h2_stream* s = (h2_stream*)ctx->writer.io;
+  if (s->reset)
+  {
+    return 1;
+  }
+  if (s->out_len + len > s->out_cap)
+  {
+    // send_data keeps the sent prefix below half the buffer, so the buffer only grows with the amount of
+    // unsent output, which HANDLER_AWAIT_DRAINED keeps around HANDLER_OUTPUT_HIGH_WATER
+    size_t cap = s->out_cap == 0 ? H2_DEFAULT_FRAME_SIZE : s->out_cap;
+    while (cap < s->out_len + len)
+    {
+      cap *= 2;
+    }
+    char* out = (char*)realloc(s->out, cap);
+    if (out == NULL)
+    {
+      perror("allocating HTTP/2 response buffer");
+      return 1;
+    }
+    s->out = out;
+    s->out_cap = cap;
+  }
+  memcpy(s->out + s->out_len, buf, len);
+  s->out_len += len;
+  return 0;
+}
+
+static int h2_end(handler_ctx* ctx)
+{
+  h2_stream* s = (h2_stream*)ctx->writer.io;
+  s->body_ended = true;
+  return 0;
+}
+
+static size_t h2_pending(handler_ctx* ctx)
+{
+  h2_stream* s = (h2_stream*)ctx->writer.io;
+  return s->out_len - s->out_pos;
+}
+
+// start_linger is called once the handler of s has completed and its response has been sent while the client is
+// still sending the request body. The body keeps being credited (and discarded) for up to H2_LINGER_MS, so the
+// client can finish the request cleanly; after that the stream is reset with NO_ERROR (see expire_lingering).
+// Resetting right away, as RFC 7540 section 8.1 allows, makes some clients discard the response
+static void start_linger(h2_stream* s)
+{
+  s->linger_deadline = handler_now_ms() + H2_LINGER_MS;
+}
+
+// expire_lingering resets the streams that have been lingering for longer than H2_LINGER_MS
+static int expire_lingering(h2_conn* c)
+{
+  long long now = handler_now_ms();
+  h2_stream* next;
+  for (h2_stream* s = c->streams; s != NULL; s = next)
+  {
+    next = s->next;
+    if (s->linger_deadline != 0 && now >= s->linger_deadline)
+    {
+      int result = send_rst_stream(c, s->id, H2_NO_ERROR);
+      close_stream(c, s);
+      if (result == -1)
+      {
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+static bool can_send(h2_stream* s)
+{
+  if (!s->dispatched || s->local_closed)
+  {
+    return false;
+  }
+  if (s->streaming)
+  {
+    // Once the handler has ended the body, END_STREAM goes out (on an empty DATA frame if need be) regardless of the window
+    return (s->out_pos < s->out_len && s->send_window > 0) || (s->body_ended && s->out_pos == s->out_len);
+  }
+  return s->body_remaining > 0 && s->send_window > 0;
+}
+
+// blocked_by_ancestor reports whether any ancestor of s in the priority tree can send right now,
+// in which case it takes precedence over s
+static bool blocked_by_ancestor(h2_conn* c, h2_stream* s)
+{
+  h2_stream* parent = find_stream(c, s->depends_on);
+  for (int depth = 0; parent != NULL && depth <= c->num_streams; ++depth)
+  {
+    if (can_send(parent))
+    {
+      return true;
+    }
+    parent = find_stream(c, parent->depends_on);
+  }
+  return false;
+}
+
+// next_sendable picks the stream that should get the next DATA frame, or NULL if none can send
+static h2_stream* next_sendable(h2_conn* c)
+{
+  if (c->send_window <= 0)
+  {
+    return NULL;
+  }
+  h2_stream* best = NULL;
+  for (h2_stream* s = c->streams; s != NULL; s = s->next)
+  {
+    if (can_send(s) && (best == NULL || s->pass < best->pass) && !blocked_by_ancestor(c, s))
+    {
+      best = s;
+    }
+  }
+  return best;
+}
+
+// send_data sends the next DATA frame of the response on stream s
+static int send_data(h2_conn* c, h2_stream* s)
+{
+  size_t len = s->streaming ? s->out_len - s->out_pos : s->body_remaining;
+  if (len > c->peer_max_frame)
+  {
+    len = c->peer_max_frame;
+  }
+  if (len > sizeof(c->wbuf) - H2_FRAME_HEADER_LEN)
+  {
+    len = sizeof(c->wbuf) - H2_FRAME_HEADER_LEN;
+  }
+  // (An empty, END_STREAM-only frame can go out whatever the windows)
+  if (len > 0 && (int64_t)len > s->send_window)
+  {
+    len = s->send_window;
+  }
+  if (len > 0 && (int64_t)len > c->send_window)
+  {
+    len = c->send_window;
+  }
+
+  uint8_t* payload = c->wbuf + H2_FRAME_HEADER_LEN;
+  if (s->streaming)
+  {
+    memcpy(payload, s->out + s->out_pos, len);
+    s->out_pos += len;
+    if (s->out_pos == s->out_len)
+    {
+      s->out_pos = s->out_len = 0;
+    } else if (s->out_pos > s->out_len / 2) {
+      // Reclaim the sent prefix, so writes append into it rather than growing the buffer
+      memmove(s->out, s->out + s->out_pos, s->out_len - s->out_pos);
+      s->out_len -= s->out_pos;
+      s->out_pos = 0;
+    }
+  } else if (s->mem_body != NULL) {
+    memcpy(payload, s->mem_body, len);
+    s->mem_body += len;
+  } else if ((len = fread(payload, 1, len, s->resp.body_fd)) == 0) {
+    perror("error reading response file");
+    send_rst_stream(c, s->id, H2_INTERNAL_ERROR);
+    close_stream(c, s);
+    return 0;
+  }
+
+  if (!s->streaming)
+  {
+    s->body_remaining -= len;
+  }
+  s->send_window -= len;
+  c->send_window -= len;
+  c->vtime = s->pass;
+  s->pass += (uint64_t)len * 256 / s->weight;
+
+  uint8_t flags = 0;
+  if (s->streaming ? s->body_ended && s->out_len == 0 : s->body_remaining == 0)
+  {
+    flags |= H2_FLAG_END_STREAM;
+    s->local_closed = true;
+  }
+  if (send_frame(c, H2_DATA, flags, s->id, payload, len) == -1)
+  {
+    return -1;
+  }
+  if (s->local_closed)
+  {
+    printf("< **END OF MESSAGE (HTTP/2 stream %u)**\n", s->id);
+    if (s->remote_closed)
+    {
+      close_stream(c, s);
+    } else if (s->handler == NULL) {
+      start_linger(s);
+    }
+  }
+  return 0;
+}
+
+// start_handler attaches a dynamic handler to stream s. It first runs from the connection loop (see run_handlers)
+static int start_handler(h2_conn* c, h2_stream* s, handler_fn fn, route_param* params, int num_params)
+{
+  printf("> REQUEST (HTTP/2 stream %u, handler):\n>\t%s %s %s\n", s->id, s->req.verb, s->req.path, s->req.version);
+  print_headers(s->req.headers, ">\t");
+  printf(">\n");
+
+  response_writer writer = { h2_begin, h2_write, h2_end, h2_pending, s };
+  if ((s->handler = handler_create(fn, &s->req, params, num_params, writer)) == NULL)
+  {
+    send_rst_stream(c, s->id, H2_INTERNAL_ERROR);
+    close_stream(c, s);
+    return 0;
+  }
+  s->streaming = true;
+  return 0;
+}
+
+// start_request is called once the headers of the request on s are complete. Requests matching a dynamic route
+// start their handler right away, so that it can consume the body as it arrives; anything else is dispatched
+// once the whole request has been received
+static int start_request(h2_conn* c, h2_stream* s)
+{
+  handler_fn fn;
+  route_param params[ROUTE_MAX_PARAMS];
+  int num_params;
+  const char* allow;
+  if (route_lookup(s->req.verb, s->req.path, &fn, params, &num_params, &allow) == 0)
+  {
+    return start_handler(c, s, fn, params, num_params);
+  }
+  return s->remote_closed ? dispatch(c, s) : 0;
+}
+
+// end_request is called when the client ends the request on s (END_STREAM)
+static int end_request(h2_conn* c, h2_stream* s)
+{
+  s->remote_closed = true;
+  if (!s->streaming)
+  {
+    return dispatch(c, s);
+  }
+  if (s->local_closed)
+  {
+    // The handler had already sent its whole response
+    close_stream(c, s);
+  }
+  return 0;
+}
+
+// run_handlers resumes every handler whose wait condition is satisfied, once
+static int run_handlers(h2_conn* c)
+{
+  long long now = handler_now_ms();
+  h2_stream* next;
+  for (h2_stream* s = c->streams; s != NULL; s = next)
+  {
+    next = s->next;
+    handler_ctx* ctx = s->handler;
+    if (ctx == NULL)
+    {
+      continue;
+    }
+    short revents = s->revents;
+    s->revents = 0;
+    size_t delivered = 0;
+    if (ctx->wait == HANDLER_WAIT_BODY)
+    {
+      if (s->in_len == 0 && !s->remote_closed)
+      {
+        continue;
+      }
+      delivered = s->in_len;
+      ctx->body_chunk = s->in;
+      ctx->body_chunk_len = s->in_len;
+      ctx->body_done = s->in_len == 0;
+    } else if (!handler_ready(ctx, now, revents)) {
+      continue;
+    }
+
+    int state = handler_step(ctx);
+    if (s->reset)
+    {
+      if (state == HANDLER_DONE)
+      {
+        handler_destroy(ctx);
+        s->handler = NULL;
+      }
+      close_stream(c, s);
+      continue;
+    }
+    if (delivered > 0)
+    {
+      // The handler is done with the chunk: let the client send more
+      s->in_len = 0;
+      if (send_window_update(c, s->id, delivered) == -1)
+      {
+        return -1;
+      }
+    }
+    if (state == HANDLER_DONE)
+    {
+      handler_destroy(ctx);
+      s->handler = NULL;
+      // Body the handler never took is discarded, and credited back so the client can finish sending the request.
+      // Later DATA frames are credited as they arrive, and the stream closes once both sides have ended it.
+      // (Resetting it with NO_ERROR, as RFC 7540 section 8.1 allows, makes some clients discard the response)
+      if (!s->remote_closed && s->in_len > 0 && send_window_update(c, s->id, s->in_len) == -1)
+      {
+        return -1;
+      }
+      s->in_len = 0;
+      if (!s->remote_closed && s->local_closed)
+      {
+        start_linger(s);
+      }
+    }
+  }
+  return 0;
+}
+
+// prepare_handler_poll adds the descriptors handlers are waiting on to fds (after the first *nfds entries), and
+// returns how long poll() may block for the sake of the handlers: 0 if one can run right away, the time until
+// the earliest handler timer or linger deadline, or -1 if handlers don't limit it
+static int prepare_handler_poll(h2_conn* c, struct pollfd* fds, nfds_t* nfds)
+{
+  long long now = handler_now_ms();
+  int timeout = -1;
+  for (h2_stream* s = c->streams; s != NULL; s = s->next)
+  {
+    handler_ctx* ctx = s->handler;
+    if (s->linger_deadline != 0)
+    {
+      int wait = s->linger_deadline <= now ? 0 : (int)(s->linger_deadline - now);
+      timeout = timeout == -1 || wait < timeout ? wait : timeout;
+    }
+    if (ctx == NULL)
+    {
+      continue;
+    }
+    if (ctx->wait == HANDLER_WAIT_FD)
+    {
+      fds[*nfds].fd = ctx->wait_fd;
+      fds[*nfds].events = ctx->wait_events;
+      fds[*nfds].revents = 0;
+      ++*nfds;
+      continue;
+    }
+    int wait;
+    if (ctx->wait == HANDLER_WAIT_TIMER)
+    {
+      wait = ctx->wait_deadline <= now ? 0 : (int)(ctx->wait_deadline - now);
+    } else if (ctx->wait == HANDLER_WAIT_BODY) {
+      wait = s->in_len > 0 || s->remote_closed ? 0 : -1;
+    } else {
+      wait = handler_ready(ctx, now, 0) ? 0 : -1;
+    }
+    if (wait != -1 && (timeout == -1 || wait < timeout))
+    {
+      timeout = wait;
+    }
+  }
+  return timeout;
+}
+
+// collect_handler_events hands the poll() results for handler descriptors (from fds[first] on) to their streams
+static void collect_handler_events(h2_conn* c, struct pollfd* fds, nfds_t first)
+{
+  nfds_t i = first;
+  for (h2_stream* s = c->streams; s != NULL; s = s->next)
+  {
+    if (s->handler != NULL && s->handler->wait == HANDLER_WAIT_FD)
+    {
+      s->revents = fds[i++].revents;
+    }
+  }
+}
+
+// apply_settings applies the settings in payload (a sequence of 6-byte identifier/value pairs)
+static int apply_settings(h2_conn* c, const uint8_t* payload, size_t len)
+{
+  for (size_t i = 0; i + 6 <= len; i += 6)
+  {
+    uint16_t id = (payload[i] << 8) | payload[i + 1];
+    uint32_t value = get32(payload + i + 2);
+    switch (id)
+    {
+      case H2_SETTINGS_HEADER_TABLE_SIZE:
+        // We never use more than HPACK_DEFAULT_TABLE_SIZE for our own encoder
+        hpack_table_resize(&c->encoder, value < HPACK_DEFAULT_TABLE_SIZE ? value : HPACK_DEFAULT_TABLE_SIZE);
+        break;
+      case H2_SETTINGS_INITIAL_WINDOW_SIZE:
+        if (value > H2_MAX_WINDOW)
+        {
+          return connection_error(c, H2_FLOW_CONTROL_ERROR);
+        }
+        // The change applies to the windows of all open streams (RFC 7540 section 6.9.2)
+        for (h2_stream* s = c->streams; s != NULL; s = s->next)
+        {
+          s->send_window += (int64_t)value - c->peer_initial_window;
+          if (s->send_window > H2_MAX_WINDOW)
+          {
+            return connection_error(c, H2_FLOW_CONTROL_ERROR);
+          }
+        }
+        c->peer_initial_window = value;
+        break;
+      case H2_SETTINGS_MAX_FRAME_SIZE:
+        if (value < H2_DEFAULT_FRAME_SIZE || value > H2_MAX_FRAME_SIZE)
+        {
+          return connection_error(c, H2_PROTOCOL_ERROR);
+        }
+        c->peer_max_frame = value;
+        break;
+      default:
+        // Unknown settings, and settings we have no use for (e.g. ENABLE_PUSH: we never push), are ignored
+        break;
+    }
+  }
+  return 0;
+}
+
+// finish_headers decodes a complete header block, opening a new stream (or completing one, for trailers)
+static int finish_headers(h2_conn* c)
+{
+  header_list* headers = NULL;
+  int decoded = hpack_decode(&c->decoder, c->hblock, c->hblock_len, &headers);
+  uint32_t id = c->hblock_stream;
+  c->hblock_stream = 0;
+  c->hblock_len = 0;
+  if (decoded == -1)
+  {
+    free_header_list(headers, true);
+    return connection_error(c, H2_COMPRESSION_ERROR);
+  }
+
+  h2_stream* s = find_stream(c, id);
+  if (s != NULL)
+  {
+    // Trailers: we have no use for them beyond ending the request
+    free_header_list(headers, true);
+    if (s->remote_closed || !c->hblock_end_stream)
+    {
+      send_rst_stream(c, id, s->remote_closed ? H2_STREAM_CLOSED : H2_PROTOCOL_ERROR);
+      close_stream(c, s);
+      return 0;
+    }
+    return end_request(c, s);
+  }
+
+  if (id <= c->last_stream_id)
+  {
+    free_header_list(headers, true);
+    return connection_error(c, H2_PROTOCOL_ERROR);
+  }
+  c->last_stream_id = id;
+  if (c->goaway_sent)
+  {
+    // We're shutting down, and told the client we won't process this stream
+    free_header_list(headers, true);
+    return 0;
+  }
+  if (c->num_streams >= H2_MAX_CONCURRENT_STREAMS)
+  {
+    free_header_list(headers, true);
+    return send_rst_stream(c, id, H2_REFUSED_STREAM);
+  }
+
+  if ((s = open_stream(c, id)) == NULL)
+  {
+    free_header_list(headers, true);
+    return send_rst_stream(c, id, H2_INTERNAL_ERROR);
+  }
+  // Pseudo-headers populate the request line; everything else becomes a regular request header
+  header_list** tail = &s->req.headers;
+  while (headers != NULL)
+  {
+    header_list* h = headers;
+    headers = headers->next;
+    h->next = NULL;
+    if (h->entry->key[0] != ':')
+    {
+      *tail = h;
+      tail = &h->next;
+      continue;
+    }
+    if (strcmp(h->entry->key, ":method") == 0 && s->req.verb == NULL)
+    {
+      s->req.verb = h->entry->value;
+      h->entry->value = NULL;
+    } else if (strcmp(h->entry->key, ":path") == 0 && s->req.path == NULL) {
+      s->req.path = h->entry->value;
+      h->entry->value = NULL;
+    }
+    free_header_list(h, true);
+  }
+  s->req.version = strdup("HTTP/2");
+  if (c->hblock_has_priority)
+  {
+    set_priority(c, s, c->hblock_depends_on, c->hblock_weight, c->hblock_exclusive);
+  }
+  if (s->req.verb == NULL || s->req.path == NULL)
+  {
+    send_rst_stream(c, id, H2_PROTOCOL_ERROR);
+    close_stream(c, s);
+    return 0;
+  }
+
+  s->remote_closed = c->hblock_end_stream;
+  return start_request(c, s);
+}
+
+// append_header_block adds a HEADERS/CONTINUATION fragment to the header block being assembled
+static int append_header_block(h2_conn* c, const uint8_t* fragment, size_t len)
+{
+  if (c->hblock_len + len > H2_MAX_HEADER_BLOCK)
+  {
+    return connection_error(c, H2_ENHANCE_YOUR_CALM);
+  }
+  if (c->hblock == NULL && (c->hblock = (uint8_t*)malloc(H2_MAX_HEADER_BLOCK)) == NULL)
+  {
+    perror("allocating header block buffer");
+    return connection_error(c, H2_INTERNAL_ERROR);
+  }
+  memcpy(c->hblock + c->hblock_len, fragment, len);
+  c->hblock_len += len;
+  return 0;
+}
+
+// strip_padding removes the padding of a PADDED frame, adjusting payload and len
+static int strip_padding(h2_conn* c, uint8_t flags, const uint8_t** payload, size_t* len)
+{
+  if ((flags & H2_FLAG_PADDED) == 0)
+  {
+    return 0;
+  }
+  if (*len < 1 || (*payload)[0] >= *len)
+  {
+    return connection_error(c, H2_PROTOCOL_ERROR);
+  }
+  size_t pad = (*payload)[0];
+  *payload += 1;
+  *len -= 1 + pad;
+  return 0;
+}
+
+// handle_frame processes a single frame from the client. It returns -1 if the connection must be closed
+static int handle_frame(h2_conn* c, uint8_t type, uint8_t flags, uint32_t id, const uint8_t* payload, size_t len)
+{
+  // Once a header block has started, nothing but its CONTINUATION frames may be interleaved
+  if (c->hblock_stream != 0 && (type != H2_CONTINUATION || id != c->hblock_stream))
+  {
+    return connection_error(c, H2_PROTOCOL_ERROR);
+  }
+
+  h2_stream* s;
+  switch (type)
+  {
+    case H2_DATA:
+    {
+      size_t frame_len = len;
+      if (id == 0 || strip_padding(c, flags, &payload, &len) == -1)
+      {
+        return connection_error(c, H2_PROTOCOL_ERROR);
+      }
+      if (id > c->last_stream_id)
+      {
+        return connection_error(c, H2_PROTOCOL_ERROR);
+      }
+      // Request bodies are consumed right away, so the whole frame (padding included) is credited back at once
+      if (frame_len > 0 && send_window_update(c, 0, frame_len) == -1)
+      {
+        return -1;
+      }
+      s = find_stream(c, id);
+      if (s == NULL || s->remote_closed)
+      {
+        return send_rst_stream(c, id, H2_STREAM_CLOSED);
+      }
+      if (s->handler != NULL)
+      {
+        // Handlers take the body at their own pace: the stream window is only credited (by run_handlers) once the
+        // handler has taken the data, so a slow handler pushes back on the client instead of buffering without bound
+        if (s->in_len + len > H2_DEFAULT_WINDOW)
+        {
+          send_rst_stream(c, id, H2_FLOW_CONTROL_ERROR);
+          close_stream(c, s);
+          return 0;
+        }
+        if (s->in == NULL && (s->in = (char*)malloc(H2_DEFAULT_WINDOW)) == NULL)
+        {
+          perror("allocating HTTP/2 request body buffer");
+          send_rst_stream(c, id, H2_INTERNAL_ERROR);
+          close_stream(c, s);
+          return 0;
+        }
+        memcpy(s->in + s->in_len, payload, len);
+        s->in_len += len;
+        if (frame_len > len && send_window_update(c, id, frame_len - len) == -1)
+        {
+          return -1;
+        }
+        return (flags & H2_FLAG_END_STREAM) ? end_request(c, s) : 0;
+      }
+      // As with HTTP/1.1, anything beyond BUF_SIZE bytes of body is dropped
+      if (s->req.body == NULL)
+      {
+        s->req.body = (char*)calloc(BUF_SIZE + 1, 1);
+      }
+      if (s->req.body != NULL && s->req_body_len < BUF_SIZE)
+      {
+        size_t n = len < BUF_SIZE - s->req_body_len ? len : BUF_SIZE - s->req_body_len;
+        memcpy(s->req.body + s->req_body_len, payload, n);
+        s->req_body_len += n;
+      }
+      if (flags & H2_FLAG_END_STREAM)
+      {
+        return end_request(c, s);
+      }
+      if (frame_len > 0)
+      {
+        return send_window_update(c, id, frame_len);
+      }
+      return 0;
+    }
+
+    case H2_HEADERS:
+      if (id == 0 || id % 2 == 0 || strip_padding(c, flags, &payload, &len) == -1)
+      {
+        return connection_error(c, H2_PROTOCOL_ERROR);
+      }
+      c->hblock_has_priority = (flags & H2_FLAG_PRIORITY) != 0;
+      if (c->hblock_has_priority)
+      {
+        if (len < 5)
+        {
+          return connection_error(c, H2_FRAME_SIZE_ERROR);
+        }
+        c->hblock_exclusive = (payload[0] & 0x80) != 0;
+        c->hblock_depends_on = get32(payload) & 0x7fffffff;
+        c->hblock_weight = payload[4] + 1;
+        payload += 5;
+        len -= 5;
+      }
+      c->hblock_stream = id;
+      c->hblock_end_stream = (flags & H2_FLAG_END_STREAM) != 0;
+      if (append_header_block(c, payload, len) == -1)
+      {
+        return -1;
+      }
+      return (flags & H2_FLAG_END_HEADERS) ? finish_headers(c) : 0;
+
+    case H2_CONTINUATION:
+      if (c->hblock_stream == 0)
+      {
+        return connection_error(c, H2_PROTOCOL_ERROR);
+      }
+      if (append_header_block(c, payload, len) == -1)
+      {
+        return -1;
+      }
+      return (flags & H2_FLAG_END_HEADERS) ? finish_headers(c) : 0;
+
+    case H2_PRIORITY:
+      if (id == 0)
+      {
+        return connection_error(c, H2_PROTOCOL_ERROR);
+      }
+      if (len != 5)
+      {
+        return send_rst_stream(c, id, H2_FRAME_SIZE_ERROR);
+      }
+      // Priorities of streams that are idle or already closed are not tracked
+      if ((s = find_stream(c, id)) != NULL)
+      {
+        set_priority(c, s, get32(payload) & 0x7fffffff, payload[4] + 1, (payload[0] & 0x80) != 0);
+      }
+      return 0;
+
+    case H2_RST_STREAM:
+      if (len != 4)
+      {
+        return connection_error(c, H2_FRAME_SIZE_ERROR);
+      }
+      if (id == 0 || id > c->last_stream_id)
+      {
+        return connection_error(c, H2_PROTOCOL_ERROR);
+      }
+      if ((s = find_stream(c, id)) != NULL)
+      {
+        close_stream(c, s);
+      }
+      return 0;
+
+    case H2_SETTINGS:
+      if (id != 0)
+      {
+        return connection_error(c, H2_PROTOCOL_ERROR);
+      }
+      if (flags & H2_FLAG_ACK)
+      {
+        return len == 0 ? 0 : connection_error(c, H2_FRAME_SIZE_ERROR);
+      }
+      if (len % 6 != 0)
+      {
+        return connection_error(c, H2_FRAME_SIZE_ERROR);
+      }
+      if (apply_settings(c, payload, len) == -1)
+      {
+        return -1;
+      }
+      return send_frame(c, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+
+    case H2_PING:
+      if (id != 0)
+      {
+        return connection_error(c, H2_PROTOCOL_ERROR);
+      }
+      if (len != 8)
+      {
+        return connection_error(c, H2_FRAME_SIZE_ERROR);
+      }
+      if (flags & H2_FLAG_ACK)
+      {
+        return 0;
+      }
+      return send_frame(c, H2_PING, H2_FLAG_ACK, 0, payload, len);
+
+    case H2_GOAWAY:
+      // The client won't open any more streams; finish the ones in flight and close
+      c->goaway_received = true;
+      return 0;
+
+    case H2_WINDOW_UPDATE:
+    {
+      if (len != 4)
+      {
+        return connection_error(c, H2_FRAME_SIZE_ERROR);
+      }
+      uint32_t increment = get32(payload) & 0x7fffffff;
+      if (id == 0)
+      {
+        c->send_window += increment;
+        if (increment == 0 || c->send_window > H2_MAX_WINDOW)
+        {
+          return connection_error(c, increment == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+        }
+        return 0;
+      }
+      if ((s = find_stream(c, id)) == NULL)
+      {
+        return 0;
+      }
+      s->send_window += increment;
+      if (increment == 0 || s->send_window > H2_MAX_WINDOW)
+      {
+        send_rst_stream(c, id, increment == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+        close_stream(c, s);
+      }
+      return 0;
+    }
+
+    case H2_PUSH_PROMISE:
+      // Clients can't push
+      return connection_error(c, H2_PROTOCOL_ERROR);
+
+    default:
+      // Unknown frame types must be ignored
+      return 0;
+  }
+}
+
+// process_input consumes the client preface and all complete frames in c->rbuf
+static int process_input(h2_conn* c)
+{
+  size_t pos = 0;
+  if (!c->preface_seen)
+  {
+    if (!is_http2_preface((char*)c->rbuf, c->rlen))
+    {
+      printf("invalid HTTP/2 connection preface\n");
+      return connection_error(c, H2_PROTOCOL_ERROR);
+    }
+    if (c->rlen < H2_PREFACE_LEN)
+    {
+      return 0;
+    }
+    c->preface_seen = true;
+    pos = H2_PREFACE_LEN;
+  }
+
+  int result = 0;
+  while (c->rlen - pos >= H2_FRAME_HEADER_LEN)
+  {
+    const uint8_t* frame = c->rbuf + pos;
+    size_t len = ((size_t)frame[0] << 16) | (frame[1] << 8) | frame[2];
+    if (len > H2_DEFAULT_FRAME_SIZE)
+    {
+      // We never advertise a larger SETTINGS_MAX_FRAME_SIZE
+      return connection_error(c, H2_FRAME_SIZE_ERROR);
+    }
+    if (c->rlen - pos < H2_FRAME_HEADER_LEN + len)
+    {
+      break;
+    }
+    result = handle_frame(c, frame[3], frame[4], get32(frame + 5) & 0x7fffffff, frame + H2_FRAME_HEADER_LEN, len);
+    pos += H2_FRAME_HEADER_LEN + len;
+    if (result == -1)
+    {
+      break;
+    }
+  }
+  memmove(c->rbuf, c->rbuf + pos, c->rlen - pos);
+  c->rlen -= pos;
+  return result;
+}
+
+// base64url_decode decodes the HTTP2-Settings header of an h2c upgrade request (RFC 7540 section 3.2.1).
+// Characters outside the alphabet (padding, whitespace) are skipped. Returns the decoded length
+static size_t base64url_decode(const char* src, uint8_t* out, size_t cap)
+{
+  uint32_t acc = 0;
+  int bits = 0;
+  size_t n = 0;
+  for (; *src != '\0'; ++src)
+  {
+    int v;
+    char ch = *src;
+    if (ch >= 'A' && ch <= 'Z') v = ch - 'A';
+    else if (ch >= 'a' && ch <= 'z') v = ch - 'a' + 26;
+    else if (ch >= '0' && ch <= '9') v = ch - '0' + 52;
+    else if (ch == '-' || ch == '+') v = 62;
+    else if (ch == '_' || ch == '/') v = 63;
+    else continue;
+    acc = (acc << 6) | v;
+    bits += 6;
+    if (bits >= 8)
+    {
+      bits -= 8;
+      if (n < cap)
+      {
+        out[n++] = (acc >> bits) & 0xff;
+      }
+    }
+  }
+  return n;
+}
+
+// serve_connection runs the HTTP/2 connection loop. If upgrade_req is not NULL, it is the HTTP/1.1 request that
+// was upgraded to HTTP/2, and is answered on stream 1
+static int serve_connection(int client_sock, const char* initial, size_t initial_len, http_req* upgrade_req)
+{
+  h2_conn* c = (h2_conn*)calloc(1, sizeof(h2_conn));
+  if (c == NULL)
+  {
+    perror("allocating HTTP/2 connection");
+    close(client_sock);
+    return 1;
+  }
+  c->sock = client_sock;
+  // Every write is a complete frame, and a frame held back by Nagle's algorithm stalls every stream behind it
+  const int SET = 1;
+  setsockopt(client_sock, IPPROTO_TCP, TCP_NODELAY, &SET, sizeof(int));
+  c->send_window = H2_DEFAULT_WINDOW;
+  c->peer_initial_window = H2_DEFAULT_WINDOW;
+  c->peer_max_frame = H2_DEFAULT_FRAME_SIZE;
+  if (hpack_table_init(&c->decoder, HPACK_DEFAULT_TABLE_SIZE) == -1 || hpack_table_init(&c->encoder, HPACK_DEFAULT_TABLE_SIZE) == -1)
+  {
+    close(client_sock);
+    return 1;
+  }
+  if (initial_len > 0)
+  {
+    memcpy(c->rbuf, initial, initial_len);
+    c->rlen = initial_len;
+  }
+
+  // Our SETTINGS must be the first frame we send
+  int result = send_settings(c);
+  if (result == 0 && c->rlen > 0)
+  {
+    result = process_input(c);
+  }
+  if (result == 0 && upgrade_req != NULL)
+  {
+    for (header_list* h = upgrade_req->headers; h != NULL; h = h->next)
+    {
+      if (strcasecmp(h->entry->key, "HTTP2-Settings") == 0)
+      {
+        uint8_t settings[256];
+        result = apply_settings(c, settings, base64url_decode(h->entry->value, settings, sizeof(settings)));
+      }
+    }
+    h2_stream* s = open_stream(c, 1);
+    if (result == 0 && s != NULL)
+    {
+      c->last_stream_id = 1;
+      s->req = *upgrade_req;
+      s->remote_closed = true;
+      result = start_request(c, s);
+    }
+  }
+
+  int drain = drain_fd;
+  while (result == 0)
+  {
+    if ((c->goaway_sent || c->goaway_received) && c->num_streams == 0)
+    {
+      break;
+    }
+    if ((result = run_handlers(c)) != 0 || (result = expire_lingering(c)) != 0)
+    {
+      break;
+    }
+    h2_stream* s = next_sendable(c);
+
+    struct pollfd fds[2 + H2_MAX_CONCURRENT_STREAMS] = {
+      { .fd = c->sock, .events = POLLIN },
+      { .fd = drain, .events = POLLIN },
+    };
+    nfds_t nfds = 2;
+    int handler_timeout = prepare_handler_poll(c, fds, &nfds);
+    // With data to send we only check for input; otherwise we block until the client (or the server, or a handler)
+    // has something for us
+    int timeout = s != NULL ? 0 : handler_timeout != -1 ? handler_timeout : H2_IDLE_TIMEOUT_MS;
+    bool handlers_busy = handler_timeout != -1 || nfds > 2;
+    int ready = poll(fds, nfds, timeout);
+    if (ready == -1)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      perror("error polling HTTP/2 connection");
+      break;
+    }
+    collect_handler_events(c, fds, 2);
+    if (ready == 0 && s == NULL && !handlers_busy)
+    {
+      // Idle for too long
+      send_goaway(c, H2_NO_ERROR);
+      break;
+    }
+    if (drain != -1 && fds[1].revents != 0)
+    {
+      // The server is draining (e.g. for an upgrade): refuse new streams, finish the ones in flight
+      printf("Server draining, closing HTTP/2 connection after stream %u\n", c->last_stream_id);
+      result = send_goaway(c, H2_NO_ERROR);
+      drain = -1;
+      continue;
+    }
+    if (fds[0].revents != 0)
+    {
+      ssize_t n = recv(c->sock, c->rbuf + c->rlen, sizeof(c->rbuf) - c->rlen, 0);
+      if (n == -1 && errno == EINTR)
+      {
+        continue;
+      }
+      if (n <= 0)
+      {
+        // The client went away (or the socket failed)
+        if (n == -1)
+        {
+          perror("error reading from HTTP/2 connection");
+        }
+        break;
+      }
+      c->rlen += n;
+      result = process_input(c);
+      continue;
+    }
+    if (s != NULL)
+    {
+      result = send_data(c, s);
+    }
+  }
+
+  while (c->streams != NULL)
+  {
+    close_stream(c, c->streams);
+  }
+  hpack_table_free(&c->decoder);
+  hpack_table_free(&c->encoder);
+  free(c->hblock);
+  free(c);
+  if (close(client_sock) == -1)
+  {
+    perror("error closing socket");
+    return 1;
+  }
+  return result == 0 ? 0 : 1;
+}
+
+int http2_serve(int client_sock, const char* initial, size_t initial_len)
+{
+  return serve_connection(client_sock, initial, initial_len, NULL);
+}
+
+int http2_upgrade(int client_sock, http_req* req)
+{
+  const char* switching = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+  printf("<\tHTTP/1.1 101 Switching Protocols (h2c)\n");
+  if (write_all(client_sock, (const uint8_t*)switching, strlen(switching)) == -1)
+  {
+    close(client_sock);
+    return 1;
+  }
+  return serve_connection(client_sock, NULL, 0, req);
+}
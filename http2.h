@@ -0,0 +1,21 @@
+#pragma once
+#include <stddef.h>
+
+#include "request_handler.h"
+
+// H2_PREFACE is the client connection preface that starts every HTTP/2 connection
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN 24
+
+// is_http2_preface reports whether the first len bytes of buf are (the start of) the HTTP/2 client preface,
+// i.e. whether the client is speaking HTTP/2 with prior knowledge
+int is_http2_preface(const char* buf, size_t len);
+
+// http2_serve runs an HTTP/2 (prior knowledge) connection on client_sock until either side closes it.
+// initial holds the bytes already read from the socket, starting with the client preface.
+// Returns 0 if the connection was shut down cleanly, 1 otherwise. client_sock is closed on return.
+int http2_serve(int client_sock, const char* initial, size_t initial_len);
+
+// http2_upgrade switches an HTTP/1.1 connection that sent `Upgrade: h2c` to HTTP/2 (RFC 7540 section 3.2).
+// The upgrade request itself is answered on stream 1 of the new connection.
+int http2_upgrade(int client_sock, http_req* req);
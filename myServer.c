@@ -2,16 +2,24 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <fcntl.h>
 #include <errno.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
 #include "request_handler.h"
+#include "upgrade.h"
+#include "router.h"
+#include "routes.h"
 
 // main instantiates a new TCP/HTTP server. Requests are handled by forking the main server
-// and having the child process take care of a given, individual, connection
+// and having the child process take care of a given, individual, connection.
+// Sending the server SIGUSR2 (or SIGHUP) hands its listening socket off to a freshly exec'd
+// binary; see upgrade.c
 int main(int argc, char** argv)
 {
   in_addr_t HOST = htonl(INADDR_ANY); // Bind to all available interfaces
@@ -32,40 +40,61 @@ int main(int argc, char** argv)
   socklen_t remote_socklen;
   int server_fd;
 
-  printf("\x1b[39;1mSetting up local http server (binding to all inet interfaces) on port \x1b[32;1m%d\x1b[39m\n",PORT);
-
-  // Create the socket
-  server_fd = socket(AF_INET, SOCK_STREAM, 0);
-  if (server_fd == -1)
+  if (install_upgrade_handlers() != 0 || open_drain_pipe() != 0)
   {
-    perror("error creating socket");
     return 1;
   }
-  // set SO_REUSEADDR so we can rebind to the same port quickly in the event of a restart
-  const int SET = 1;
-  if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &SET, sizeof(int)) < 0)
-  {
-    printf("setsockopt(SO_REUSEADDR) failed\n");
-    return 1;
-  }
-  // Configure to listen on HOST:PORT
-  server_addr.sin_family = AF_INET;
-  server_addr.sin_addr.s_addr = HOST;
-  server_addr.sin_port = htons(PORT);
 
-  // Bind socket to server_addr
-  if (bind(server_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) == -1)
+  // Build the dynamic handler trie once, before forking, so every connection shares it
+  if (register_builtin_routes() != 0 || routes_compile() != 0)
   {
-    perror("error binding socket");
     return 1;
   }
 
-  // Set the server to passively wait for connections, allowing MAX_CONNS requests to queue
-  if (listen(server_fd, MAX_CONNS) == -1)
+  // If we were exec'd by a running server as part of an upgrade, take over its listening socket instead of binding our own
+  if ((server_fd = inherit_listener()) == -1)
   {
-    perror("error listening on socket");
-    return 1;
+    printf("\x1b[39;1mSetting up local http server (binding to all inet interfaces) on port \x1b[32;1m%d\x1b[39m\n",PORT);
+
+    // Create the socket
+    server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (server_fd == -1)
+    {
+      perror("error creating socket");
+      return 1;
+    }
+    // set SO_REUSEADDR so we can rebind to the same port quickly in the event of a restart
+    const int SET = 1;
+    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &SET, sizeof(int)) < 0)
+    {
+      printf("setsockopt(SO_REUSEADDR) failed\n");
+      return 1;
+    }
+    // Configure to listen on HOST:PORT
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = HOST;
+    server_addr.sin_port = htons(PORT);
+
+    // Bind socket to server_addr
+    if (bind(server_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) == -1)
+    {
+      perror("error binding socket");
+      return 1;
+    }
+
+    // Set the server to passively wait for connections, allowing MAX_CONNS requests to queue
+    if (listen(server_fd, MAX_CONNS) == -1)
+    {
+      perror("error listening on socket");
+      return 1;
+    }
   }
+  // Don't leak the listener into exec'd children; upgrades pass it explicitly
+  fcntl(server_fd, F_SETFD, FD_CLOEXEC);
+
+  // Pull web files into the OS caches before we start taking over traffic
+  warm_web_cache(WEB_DIR);
+  announce_ready();
 
   printf("Socket successfully bound, awaiting incoming connections...\n");
 
@@ -75,12 +104,69 @@ int main(int argc, char** argv)
     The server forks on each new connection: the parent process immediately closes the client socket and
     begins waiting for a new connection. The child process the takes responsibility for servicing the request.
     We expect each incoming READ to be an HTTP request, otherwise we return an appropriate HTTP error.
+
+    While an upgrade is in progress we keep accepting until the new server generation reports it is ready,
+    at which point we stop accepting, wait for our in-flight connections to finish, and exit.
 */
+  int upgrade_sock = -1;
   while(1)
   {
     int client_sock;
     pid_t child_process;
 
+    // Reap finished connection processes so they don't pile up as zombies
+    pid_t finished;
+    while ((finished = waitpid(-1, NULL, WNOHANG)) > 0)
+    {
+      connection_finished(finished);
+    }
+
+    if (upgrade_requested)
+    {
+      upgrade_requested = 0;
+      if (upgrade_sock == -1)
+      {
+        upgrade_sock = begin_upgrade(argv, server_fd);
+      }
+    }
+
+    struct pollfd fds[3] = {
+      { .fd = server_fd, .events = POLLIN },
+      { .fd = upgrade_signal_fd, .events = POLLIN },
+      { .fd = upgrade_sock, .events = POLLIN },
+    };
+    if (poll(fds, 3, -1) == -1)
+    {
+      if (errno != EINTR)
+      {
+        perror("error polling listening socket");
+      }
+      continue;
+    }
+    if (fds[1].revents != 0)
+    {
+      // An upgrade signal arrived, or a connection process exited: both are handled at the top of the loop
+      clear_upgrade_signal();
+      continue;
+    }
+    if (upgrade_sock != -1 && fds[2].revents != 0)
+    {
+      int ready = finish_upgrade(upgrade_sock);
+      upgrade_sock = -1;
+      if (ready == 0)
+      {
+        close(server_fd);
+        drain_connections();
+        return 0;
+      }
+      continue;
+    }
+    if (fds[0].revents == 0)
+    {
+      continue;
+    }
+
+    remote_socklen = sizeof(remote_addr);
     if ((client_sock = accept(server_fd, (struct sockaddr*)&remote_addr, &remote_socklen)) == -1)
     {
       // Log the error but don't kill the server (the problem could be intermittent)
@@ -89,7 +175,9 @@ int main(int argc, char** argv)
     }
 
     // accept() returns a dedicated socket for the connection. We fork the process, close the new connection in the parent,
-    // and let the child process handle the request, closing it only after the session is terminated
+    // and let the child process handle the request, closing it only after the session is terminated.
+    // Flush first so the child doesn't inherit (and later re-emit) our buffered log output
+    fflush(stdout);
     if ((child_process = fork()) == -1)
     {
       // Log the error but don't kill the server (the problem could be intermittent)
@@ -99,11 +187,21 @@ int main(int argc, char** argv)
     else if (child_process > 0)
     {
       // We are in the parent process. Close the accepted socket (it is the child process's responsibility now) and prepare to accept a new connection
+      connection_started(child_process);
       close(client_sock);
       continue;
     } else {
-      // We are in the forked child process. Handle the new connection in this subprocess from here on out
-      handle_conn(client_sock);
+      // We are in the forked child process. Handle the new connection in this subprocess from here on out,
+      // then exit rather than falling back into the accept loop
+      close(server_fd);
+      close_drain_writer();
+      // Processes this connection might start are its own business: don't wake the accepting server for them
+      signal(SIGCHLD, SIG_DFL);
+      if (upgrade_sock != -1)
+      {
+        close(upgrade_sock);
+      }
+      exit(handle_conn(client_sock));
     }
   }
 }
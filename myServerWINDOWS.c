@@ -9,6 +9,8 @@
 #include <arpa/inet.h>
 
 #include "request_handler.h"
+#include "router.h"
+#include "routes.h"
 
 /*
   myServerWINDOWS is for compatibility with Windows systems. It foregoes the use of forking
@@ -38,6 +40,11 @@ int main(int argc, char** argv)
   socklen_t remote_socklen;
   int server_fd;
 
+  if (register_builtin_routes() != 0 || routes_compile() != 0)
+  {
+    return 1;
+  }
+
   printf("\x1b[39;1mSetting up local http server (binding to all inet interfaces) on port \x1b[32;1m%d\x1b[39m\n",PORT);
 
   // Create the socket
@@ -9,9 +9,14 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <stdbool.h>
+#include <strings.h>
+#include <poll.h>
+#include <ctype.h>
 
 #include "request_handler.h"
 #include "parse.h"
+#include "http2.h"
+#include "handler.h"
 
 // WEB_DIR is the (relative to project root) directory that contains the files visible to the webserver4
 // TODO paths that contain `../` in one form or another should serve a 422 Unprocessable Entity error.
@@ -45,6 +50,13 @@ int handle_conn(int client_sock)
   }
 
   buffer[bytes_read+1] = '\0';  // Defensively ensure we have a null byte available in case request was too big (we just drop whatever didn't fit)
+
+  // HTTP/2 with prior knowledge: the connection starts with the HTTP/2 preface rather than a request line
+  if (is_http2_preface(buffer, bytes_read))
+  {
+    return http2_serve(client_sock, buffer, bytes_read);
+  }
+
   if ((parse_http_req(buffer, bytes_read, &request)) == -1)
   {
     printf("error parsing HTTP request\n");
@@ -52,6 +64,29 @@ int handle_conn(int client_sock)
     return 1;
   }
 
+  // HTTP/2 via Upgrade: h2c. The upgraded request is answered on stream 1 of the new HTTP/2 connection.
+  // A request with a body would have to be read in full before switching, so it is simply served over HTTP/1.1
+  if (header_has_token(request.headers, "Upgrade", "h2c") && header_has_token(request.headers, "Connection", "HTTP2-Settings") &&
+      !request_has_body(&request))
+  {
+    return http2_upgrade(client_sock, &request);
+  }
+
+  // Dynamic handlers take precedence over files in WEB_DIR
+  handler_fn fn;
+  route_param params[ROUTE_MAX_PARAMS];
+  int num_params;
+  const char* allow;
+  int route = route_lookup(request.verb, request.path, &fn, params, &num_params, &allow);
+  if (route == 0)
+  {
+    return serve_dynamic(client_sock, &request, fn, params, num_params, buffer, bytes_read);
+  } else if (route == 405) {
+    write_method_not_allowed(client_sock, allow);
+    close(client_sock);
+    return 1;
+  }
+
   int response_code;
   if ((response_code = serve_response(client_sock, &request, &response)) != 0)
   {
@@ -114,19 +149,25 @@ int parse_http_req(char* buf, size_t buf_len, http_req* req)
   return 0;
 }
 
-// serve_response serves the request specified by req, using resp 
-int serve_response(int client_sock, http_req* req, http_resp* resp)
+// prepare_response resolves the request specified by req to a file under WEB_DIR, opening it and
+// populating the status, headers and body of resp. It does not write anything to the client, so
+// it can be shared by the HTTP/1.1 and HTTP/2 code paths.
+int prepare_response(http_req* req, http_resp* resp)
 {
-  printf("< RESPONSE:\n");
-  char* local_path = (char*)malloc(strlen(WEB_DIR) + strlen(req->path) + 1); // +1 for \0 byte
-  strncat(local_path, WEB_DIR, strlen(WEB_DIR));
-  strncat(local_path, req->path, strlen(req->path));
   char EMPTY_PATH[2] = "/";
   if ((strncmp(req->path, EMPTY_PATH, 2)) == 0)
   {
     // Per assignment specification, / returns a 404
     return 404;
   }
+  char* local_path = (char*)malloc(strlen(WEB_DIR) + strlen(req->path) + 1); // +1 for \0 byte
+  if (local_path == NULL)
+  {
+    perror("error allocating local path");
+    return 500;
+  }
+  strcpy(local_path, WEB_DIR);
+  strcat(local_path, req->path);
 
   // Check path exists
   struct stat st;
@@ -146,12 +187,12 @@ int serve_response(int client_sock, http_req* req, http_resp* resp)
   }
   free(local_path);
 
-  // We are ready to send
   // Currently, we only make a Content-Type and Content-Length header for the response.
   // For expedience, I've done this straight inline. A better approach will be to
   // have an interface for adding entries to the header list, and feed it a list of generator functions
   // as needed
   resp->status_code = 200;
+  resp->status_text = "OK";
   header_list* header = (header_list*)malloc(sizeof(header_list));
   resp->headers = header;
   header->entry = (header_entry*)malloc(sizeof(header_entry));
@@ -160,6 +201,8 @@ int serve_response(int client_sock, http_req* req, http_resp* resp)
   if ((header->entry->value) == NULL)
   {
     printf("Expected Content-Type but got NULL");
+    fclose(resp->body_fd);
+    resp->body_fd = NULL;
     return 422;
   }
   header = (header_list*)malloc(sizeof(header_list));
@@ -167,7 +210,21 @@ int serve_response(int client_sock, http_req* req, http_resp* resp)
   header->entry = (header_entry*)malloc(sizeof(header_entry));
   header->entry->key = "Content-Length";
   header->entry->value = get_content_length(resp->body_fd);
+  header->next = NULL;
+  return 0;
+}
 
+// serve_response serves the request specified by req over HTTP/1.1, using resp
+int serve_response(int client_sock, http_req* req, http_resp* resp)
+{
+  printf("< RESPONSE:\n");
+  int status;
+  if ((status = prepare_response(req, resp)) != 0)
+  {
+    return status;
+  }
+
+  // We are ready to send
   printf("<\tHTTP/1.1 200 OK\n");
   print_headers(resp->headers, "<\t");
 
@@ -206,17 +263,429 @@ int serve_response(int client_sock, http_req* req, http_resp* resp)
   return 0;
 }
 
+// http1_writer is the response_writer state for a handler serving an HTTP/1.1 request
+typedef struct {
+  int client_sock;
+  bool chunked;
+} http1_writer;
+
+// write_all writes all len bytes of buf to sock, retrying on partial writes
+static int write_all(int sock, const char* buf, size_t len)
+{
+  while (len > 0)
+  {
+    ssize_t n = write(sock, buf, len);
+    if (n == -1)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      perror("writing to client socket");
+      return 1;
+    }
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int http1_begin(handler_ctx* ctx)
+{
+  http1_writer* w = (http1_writer*)ctx->writer.io;
+  // Without a Content-Length, the body is streamed using chunked transfer encoding
+  w->chunked = true;
+  for (header_list* h = ctx->resp->headers; h != NULL; h = h->next)
+  {
+    if (strcasecmp(h->entry->key, "Content-Length") == 0)
+    {
+      w->chunked = false;
+    }
+  }
+
+  printf("< RESPONSE (handler):\n<\tHTTP/1.1 %d %s\n", ctx->resp->status_code, ctx->resp->status_text);
+  print_headers(ctx->resp->headers, "<\t");
+  char buf[BUF_SIZE];
+  int len = snprintf(buf, sizeof(buf), "HTTP/1.1 %d %s\r\n", ctx->resp->status_code, ctx->resp->status_text);
+  for (header_list* h = ctx->resp->headers; h != NULL && len < (int)sizeof(buf); h = h->next)
+  {
+    len += snprintf(buf + len, sizeof(buf) - len, "%s: %s\r\n", h->entry->key, h->entry->value);
+  }
+  if (len < (int)sizeof(buf))
+  {
+    len += snprintf(buf + len, sizeof(buf) - len, "%sConnection: close\r\n\r\n", w->chunked ? "Transfer-Encoding: chunked\r\n" : "");
+  }
+  if (len >= (int)sizeof(buf))
+  {
+    printf("response headers too large\n");
+    return 1;
+  }
+  return write_all(w->client_sock, buf, len);
+}
+
+static int http1_write(handler_ctx* ctx, const char* buf, size_t len)
+{
+  http1_writer* w = (http1_writer*)ctx->writer.io;
+  if (w->chunked)
+  {
+    char size[32];
+    int n = snprintf(size, sizeof(size), "%zx\r\n", len);
+    if (write_all(w->client_sock, size, n) != 0 || write_all(w->client_sock, buf, len) != 0)
+    {
+      return 1;
+    }
+    return write_all(w->client_sock, "\r\n", 2);
+  }
+  return write_all(w->client_sock, buf, len);
+}
+
+static int http1_end(handler_ctx* ctx)
+{
+  http1_writer* w = (http1_writer*)ctx->writer.io;
+  printf("< **END OF MESSAGE**\n");
+  return w->chunked ? write_all(w->client_sock, "0\r\n\r\n", 5) : 0;
+}
+
+static size_t http1_pending(handler_ctx* ctx)
+{
+  // Writes go straight to the socket
+  return 0;
+}
+
+// Parser states for chunked transfer coding (RFC 7230 section 4.1)
+#define CHUNK_SIZE 0      // the hex chunk size
+#define CHUNK_EXT 1       // chunk extensions, up to the end of the size line
+#define CHUNK_DATA 2      // chunk_left bytes of data
+#define CHUNK_DATA_END 3  // the CRLF following the data
+#define CHUNK_TRAILER 4   // trailer fields, up to an empty line
+#define CHUNK_DONE 5
+
+// http1_body reads the body of an HTTP/1.1 request on behalf of a handler, undoing its framing
+// (Content-Length or chunked transfer coding)
+typedef struct {
+  int client_sock;
+  char* buffered;           // body bytes that arrived along with the headers, not yet consumed
+  size_t buffered_len;
+  bool chunked;
+  long long remaining;      // Content-Length framing: bytes of body not yet consumed
+  int chunk_state;
+  size_t chunk_left;        // chunked framing: data left in the current chunk (or its size, while parsing it)
+  int chunk_size_digits;
+  bool trailer_line_empty;
+  char raw[BUF_SIZE];
+} http1_body;
+
+static bool body_complete(http1_body* b)
+{
+  return b->chunked ? b->chunk_state == CHUNK_DONE : b->remaining == 0;
+}
+
+// end_chunk_size_line moves on from a chunk size line: to the chunk's data, or to the trailer after the last chunk
+static int end_chunk_size_line(http1_body* b)
+{
+  if (b->chunk_size_digits == 0)
+  {
+    return -1;
+  }
+  b->chunk_state = b->chunk_left == 0 ? CHUNK_TRAILER : CHUNK_DATA;
+  b->trailer_line_empty = true;
+  return 0;
+}
+
+// dechunk strips the chunked framing from the len bytes in data, in place. It returns the number of
+// bytes of body left at the start of data, or -1 if the framing is malformed
+static ssize_t dechunk(http1_body* b, char* data, size_t len)
+{
+  size_t out = 0;
+  size_t i = 0;
+  while (i < len && b->chunk_state != CHUNK_DONE)
+  {
+    char ch = data[i];
+    switch (b->chunk_state)
+    {
+      case CHUNK_SIZE:
+        ++i;
+        if (isxdigit((unsigned char)ch))
+        {
+          if (b->chunk_size_digits == 2 * sizeof(size_t) - 1)
+          {
+            return -1;
+          }
+          b->chunk_left = b->chunk_left * 16 + (ch <= '9' ? ch - '0' : tolower((unsigned char)ch) - 'a' + 10);
+          ++b->chunk_size_digits;
+        } else if (ch == ';' || ch == ' ' || ch == '\t' || ch == '\r') {
+          b->chunk_state = CHUNK_EXT;
+        } else if (ch != '\n' || end_chunk_size_line(b) == -1) {
+          return -1;
+        }
+        break;
+      case CHUNK_EXT:
+        ++i;
+        if (ch == '\n' && end_chunk_size_line(b) == -1)
+        {
+          return -1;
+        }
+        break;
+      case CHUNK_DATA:
+      {
+        size_t n = len - i < b->chunk_left ? len - i : b->chunk_left;
+        memmove(data + out, data + i, n);
+        out += n;
+        i += n;
+        b->chunk_left -= n;
+        if (b->chunk_left == 0)
+        {
+          b->chunk_state = CHUNK_DATA_END;
+        }
+        break;
+      }
+      case CHUNK_DATA_END:
+        ++i;
+        if (ch == '\n')
+        {
+          b->chunk_state = CHUNK_SIZE;
+          b->chunk_size_digits = 0;
+        } else if (ch != '\r') {
+          return -1;
+        }
+        break;
+      case CHUNK_TRAILER:
+        ++i;
+        if (ch == '\n')
+        {
+          if (b->trailer_line_empty)
+          {
+            b->chunk_state = CHUNK_DONE;
+          }
+          b->trailer_line_empty = true;
+        } else if (ch != '\r') {
+          b->trailer_line_empty = false;
+        }
+        break;
+    }
+  }
+  return out;
+}
+
+// parse_content_length parses a Content-Length value: decimal digits only (surrounding whitespace, and the CR
+// the header parser leaves on values, aside),
+// without overflow. Returns -1 if value isn't a valid length
+static int parse_content_length(const char* value, long long* length)
+{
+  while (*value == ' ' || *value == '\t')
+  {
+    ++value;
+  }
+  if (!isdigit((unsigned char)*value))
+  {
+    return -1;
+  }
+  char* end;
+  errno = 0;
+  long long n = strtoll(value, &end, 10);
+  while (*end == ' ' || *end == '\t' || *end == '\r')
+  {
+    ++end;
+  }
+  if (errno == ERANGE || *end != '\0')
+  {
+    return -1;
+  }
+  *length = n;
+  return 0;
+}
+
+// read_body_chunk sets *chunk/*len to the next part of the request body, or *len to 0 once the body is complete.
+// Returns -1 if the body can't be read in full (the client went away, or the framing is malformed)
+static int read_body_chunk(http1_body* b, const char** chunk, size_t* len)
+{
+  while (!body_complete(b))
+  {
+    char* data;
+    ssize_t n;
+    if (b->buffered_len > 0)
+    {
+      data = b->buffered;
+      n = b->buffered_len;
+      b->buffered_len = 0;
+    } else {
+      size_t want = sizeof(b->raw);
+      if (!b->chunked && b->remaining >= 0 && b->remaining < (long long)want)
+      {
+        want = (size_t)b->remaining;
+      }
+      while ((n = recv(b->client_sock, b->raw, want, 0)) == -1 && errno == EINTR);
+      if (n <= 0)
+      {
+        if (n == -1)
+        {
+          perror("error reading request body");
+        } else {
+          printf("client closed the connection before sending the whole request body\n");
+        }
+        return -1;
+      }
+      data = b->raw;
+    }
+
+    if (b->chunked)
+    {
+      if ((n = dechunk(b, data, n)) == -1)
+      {
+        printf("malformed chunked request body\n");
+        return -1;
+      }
+    } else if (n > b->remaining) {
+      n = b->remaining;
+    }
+    if (n > 0)
+    {
+      b->remaining -= b->chunked ? 0 : n;
+      *chunk = data;
+      *len = n;
+      return 0;
+    }
+  }
+  *len = 0;
+  return 0;
+}
+
+// serve_dynamic runs the dynamic handler fn for req, resuming it each time what it yielded on is ready.
+// buffer holds the bytes_read bytes of the request read so far (including the start of the body, if any);
+// the rest of the body is read from client_sock as the handler asks for it
+int serve_dynamic(int client_sock, http_req* req, handler_fn fn, route_param* params, int num_params, char* buffer, size_t bytes_read)
+{
+  // Whatever followed the headers in buffer is the start of the body
+  http1_body body = { .client_sock = client_sock, .chunk_state = CHUNK_SIZE };
+  body.buffered = buffer + bytes_read;
+  for (size_t i = 0; i + 4 <= bytes_read; ++i)
+  {
+    if (memcmp(buffer + i, "\r\n\r\n", 4) == 0)
+    {
+      body.buffered = buffer + i + 4;
+      break;
+    }
+  }
+  body.buffered_len = buffer + bytes_read - body.buffered;
+  // Chunked transfer coding takes precedence over Content-Length (RFC 7230 section 3.3.3).
+  // An invalid Content-Length, or repeats that disagree, leave the body's length unknown: reject the request
+  bool has_length = false;
+  for (header_list* h = req->headers; h != NULL; h = h->next)
+  {
+    if (strcasecmp(h->entry->key, "Content-Length") == 0)
+    {
+      long long length;
+      if (parse_content_length(h->entry->value, &length) == -1 || (has_length && length != body.remaining))
+      {
+        printf("invalid Content-Length: %s\n", h->entry->value);
+        write_http_error(client_sock, 400);
+        close(client_sock);
+        return 1;
+      }
+      body.remaining = length;
+      has_length = true;
+    } else if (strcasecmp(h->entry->key, "Transfer-Encoding") == 0) {
+      body.chunked = true;
+    }
+  }
+  if (body.chunked && !header_has_token(req->headers, "Transfer-Encoding", "chunked"))
+  {
+    // Any other transfer coding leaves us no way to find the end of the body
+    write_http_error(client_sock, 411);
+    close(client_sock);
+    return 1;
+  }
+
+  http1_writer w = { .client_sock = client_sock, .chunked = false };
+  response_writer writer = { http1_begin, http1_write, http1_end, http1_pending, &w };
+  handler_ctx* ctx = handler_create(fn, req, params, num_params, writer);
+  if (ctx == NULL)
+  {
+    write_http_error(client_sock, 500);
+    close(client_sock);
+    return 1;
+  }
+
+  // Clients sending `Expect: 100-continue` hold the body back until told to go ahead (or they give up waiting).
+  // The interim response has to precede the handler's own
+  if (!body_complete(&body) && body.buffered_len == 0 && header_has_token(req->headers, "Expect", "100-continue"))
+  {
+    const char* go_ahead = "HTTP/1.1 100 Continue\r\n\r\n";
+    write_all(client_sock, go_ahead, strlen(go_ahead));
+  }
+
+  int result = 0;
+  while (handler_step(ctx) == HANDLER_YIELD)
+  {
+    if (ctx->wait == HANDLER_WAIT_BODY)
+    {
+      if (read_body_chunk(&body, &ctx->body_chunk, &ctx->body_chunk_len) == -1)
+      {
+        // Never hand the handler a truncated or corrupted body: abandon the request instead
+        if (!ctx->resp_started)
+        {
+          write_http_error(client_sock, 400);
+        }
+        result = 1;
+        break;
+      }
+      ctx->body_done = ctx->body_chunk_len == 0;
+      continue;
+    }
+    // Each connection has a process of its own, so waiting here holds up nobody else
+    struct pollfd pfd = { .fd = ctx->wait == HANDLER_WAIT_FD ? ctx->wait_fd : -1, .events = ctx->wait_events };
+    while (!handler_ready(ctx, handler_now_ms(), pfd.revents))
+    {
+      int timeout = -1;
+      if (ctx->wait == HANDLER_WAIT_TIMER)
+      {
+        long long left = ctx->wait_deadline - handler_now_ms();
+        timeout = left < 0 ? 0 : (int)left;
+      }
+      if (poll(&pfd, 1, timeout) == -1 && errno != EINTR)
+      {
+        perror("error waiting on handler");
+        break;
+      }
+    }
+  }
+
+  handler_destroy(ctx);
+  if (close(client_sock) == -1)
+  {
+    perror("error closing socket");
+    return 1;
+  }
+  return result;
+}
+
 // write_http_error can be called when processing a given request fails
-// before beginning to write the response. It simply returns the first
-// line of the HTTP response and closes the connection
+// before beginning to write the response. It writes a complete, bodiless
+// response carrying status_code
 void write_http_error(int client_socket, int status_code)
 {
   char buf[BUF_SIZE];
-  sprintf(buf, "HTTP/1.1 %d ERROR", status_code);
-  printf("<\t%s\n", buf);
+  sprintf(buf, "HTTP/1.1 %d %s\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", status_code, status_text(status_code));
+  printf("<\tHTTP/1.1 %d %s\n", status_code, status_text(status_code));
   write(client_socket, buf, strlen(buf));
 }
 
+// write_method_not_allowed writes a complete, bodiless 405 response. allow
+// lists the methods the resource does support (RFC 7231 section 6.5.5)
+void write_method_not_allowed(int client_socket, const char* allow)
+{
+  char buf[BUF_SIZE];
+  int len = snprintf(buf, sizeof(buf), "HTTP/1.1 405 %s\r\nAllow: %s\r\nContent-Length: 0\r\nConnection: close\r\n\r\n",
+                     status_text(405), allow);
+  if (len < 0 || (size_t)len >= sizeof(buf))
+  {
+    write_http_error(client_socket, 405);
+    return;
+  }
+  printf("<\tHTTP/1.1 405 %s\n", status_text(405));
+  write(client_socket, buf, len);
+}
+
 // Callers are responsible for freeing the returned char* returned by get_content_type
 char* get_content_type(char* path)
 {
@@ -281,6 +750,63 @@ void print_headers(header_list* headers, char* prefix)
 void serve_404_page(int client_sock, http_req* request, http_resp* response)
 {
   char buf[BUF_SIZE];
-  sprintf(buf, "HTTP/1.1 404 NOTFOUND\nContent-Type: text/html\n\n<html><body><h1>404 Not Found</h1></body></html>\n");
+  sprintf(buf, "HTTP/1.1 404 NOTFOUND\nContent-Type: text/html\n\n%s", NOT_FOUND_PAGE);
   write(client_sock, &buf, strlen(buf));
 }
+
+// header_has_token reports whether headers contain a header named key (case-insensitively) whose
+// value contains token (also case-insensitively), e.g. header_has_token(headers, "Upgrade", "h2c")
+bool header_has_token(header_list* headers, char* key, char* token)
+{
+  size_t token_len = strlen(token);
+  for (header_list* current = headers; current != NULL; current = current->next)
+  {
+    if (strcasecmp(current->entry->key, key) != 0)
+    {
+      continue;
+    }
+    for (char* c = current->entry->value; *c != '\0'; ++c)
+    {
+      if (strncasecmp(c, token, token_len) == 0)
+      {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+// request_has_body reports whether req announces a body, with a non-zero Content-Length or a Transfer-Encoding
+bool request_has_body(http_req* req)
+{
+  for (header_list* current = req->headers; current != NULL; current = current->next)
+  {
+    if (strcasecmp(current->entry->key, "Transfer-Encoding") == 0 ||
+        (strcasecmp(current->entry->key, "Content-Length") == 0 && strtoul(current->entry->value, NULL, 10) > 0))
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+const char* status_text(int status)
+{
+  switch (status)
+  {
+    case 200: return "OK";
+    case 201: return "Created";
+    case 204: return "No Content";
+    case 400: return "Bad Request";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 411: return "Length Required";
+    case 413: return "Payload Too Large";
+    case 422: return "Unprocessable Entity";
+    case 500: return "Internal Server Error";
+    case 502: return "Bad Gateway";
+    case 503: return "Service Unavailable";
+    case 504: return "Gateway Timeout";
+    default: return "Unknown";
+  }
+}
@@ -1,8 +1,18 @@
 #pragma once
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "router.h"
 
 #define MAX_CONNS 20
 #define BUF_SIZE 8096
 
+// NOT_FOUND_PAGE is the body of the default 404 page
+#define NOT_FOUND_PAGE "<html><body><h1>404 Not Found</h1></body></html>\n"
+
+// WEB_DIR is the (relative to project root) directory that contains the files visible to the webserver
+extern char* WEB_DIR;
+
 // forward declare recursive structure
 typedef struct header_list header_list;
 
@@ -46,18 +56,31 @@ int handle_conn(int client_sock);
 // event of a parse failure.
 int parse_http_req(char* buffer, size_t buf_len, http_req* req);
 
+// prepare_response resolves the request encapsulated in req to a file in WEB_DIR, filling in
+// the status, headers, and body_fd of resp without writing anything to the client.
+// Returns 0 on success, otherwise the HTTP status code to be used in the (error) response
+int prepare_response(http_req* req, http_resp* resp);
+
 // serve_response attempts to create a valid HTTP response for the request
 // encapsulated in req. The return value is the HTTP status code to be used in the response
 int serve_response(int client_sock, http_req* req, http_resp* resp);
 
+// serve_dynamic serves req with the dynamic handler fn matched by route_lookup (see handler.h).
+// buffer holds the bytes_read bytes of the request that have been read from client_sock so far
+int serve_dynamic(int client_sock, http_req* req, handler_fn fn, route_param* params, int num_params, char* buffer, size_t bytes_read);
+
 // serve_404_page returns a default 404 page to the client
 void serve_404_page(int client_sock, http_req* request, http_resp* response);
 
 // write_http_error can be called when processing a given request fails
-// before beginning to write the response. It simply returns the first
-// line of the HTTP response and closes the connection
+// before beginning to write the response. It writes a complete, bodiless
+// response carrying status_code
 void write_http_error(int client_sock, int status_code);
 
+// write_method_not_allowed writes a complete, bodiless 405 response whose
+// Allow header lists the methods allow (e.g. "GET, POST")
+void write_method_not_allowed(int client_sock, const char* allow);
+
 // get_content_type attemps to discern the (MIME) Content-Type associated
 // with path. If unable to do so, get_content_type returns NULL
 char* get_content_type(char* path);
@@ -66,5 +89,15 @@ char* get_content_type(char* path);
 // On return, file's current position will be set to the beginning of file
 char* get_content_length(FILE* file);
 
+// header_has_token reports whether headers contain a header named key whose value contains token.
+// Both comparisons are case-insensitive
+bool header_has_token(header_list* headers, char* key, char* token);
+
+// request_has_body reports whether req announces a body (a non-zero Content-Length, or a Transfer-Encoding)
+bool request_has_body(http_req* req);
+
+// status_text returns the reason phrase for an HTTP status code
+const char* status_text(int status);
+
 // print_headers is a utility method for outputting headers (e.g. to log output)
 void print_headers(header_list* headers, char* prefix);
@@ -0,0 +1,449 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "router.h"
+
+/*
+  router.c maps (method, path) pairs to dynamic handlers using a radix trie.
+
+  Routes are first inserted into a pointer-based trie whose edges carry the literal text shared by the routes
+  below them. routes_compile then flattens that trie into a single array of nodes (the static children of a node
+  are contiguous and sorted by their first byte, so they can be binary searched), a single string pool, and a
+  single array of (method, handler) pairs. Lookups only ever touch those three arrays, and never allocate.
+*/
+
+// route_method associates a method with the handler serving it
+typedef struct {
+  char* method;
+  handler_fn fn;
+} route_method;
+
+typedef struct build_node build_node;
+
+// build_node is a trie node used while routes are being registered
+struct build_node {
+  char* prefix;          // literal text on the edge into this node (NULL for `:name` and `*name` nodes)
+  char* param_name;      // capture name of `:name` and `*name` nodes
+  build_node** children; // literal children
+  int num_children;
+  build_node* param;     // `:name` child
+  build_node* wildcard;  // `*name` child
+  route_method* methods;
+  int num_methods;
+};
+
+// route_node is a node of the compiled trie
+typedef struct {
+  uint32_t prefix;       // offset of the edge text into route_strings
+  uint32_t prefix_len;
+  uint32_t param_name;   // offset of the capture name into route_strings
+  uint32_t first_child;  // index of the first literal child in route_nodes
+  uint32_t num_children;
+  int32_t param;         // index of the `:name` child, or -1
+  int32_t wildcard;      // index of the `*name` child, or -1
+  uint32_t first_method; // index of the first method in route_methods
+  uint32_t num_methods;
+  uint32_t allow;        // offset into route_strings of the methods as an Allow header value, e.g. "GET, POST"
+} route_node;
+
+static build_node* build_root = NULL;
+
+static route_node* route_nodes = NULL;
+static char* route_strings = NULL;
+static size_t route_strings_len = 0;
+static route_method* route_methods = NULL;
+
+static build_node* new_build_node(const char* prefix, size_t prefix_len)
+{
+  build_node* node = (build_node*)calloc(1, sizeof(build_node));
+  if (node != NULL && prefix != NULL)
+  {
+    node->prefix = strndup(prefix, prefix_len);
+  }
+  return node;
+}
+
+static int add_method(build_node* node, const char* method, handler_fn fn)
+{
+  for (int i = 0; i < node->num_methods; ++i)
+  {
+    if (strcmp(node->methods[i].method, method) == 0)
+    {
+      printf("route already registered for method %s\n", method);
+      return 1;
+    }
+  }
+  route_method* methods = (route_method*)realloc(node->methods, sizeof(route_method) * (node->num_methods + 1));
+  if (methods == NULL)
+  {
+    perror("allocating route methods");
+    return 1;
+  }
+  node->methods = methods;
+  node->methods[node->num_methods].method = strdup(method);
+  node->methods[node->num_methods].fn = fn;
+  ++node->num_methods;
+  return 0;
+}
+
+static int add_child(build_node* node, build_node* child)
+{
+  build_node** children = (build_node**)realloc(node->children, sizeof(build_node*) * (node->num_children + 1));
+  if (children == NULL)
+  {
+    perror("allocating route trie node");
+    return 1;
+  }
+  node->children = children;
+  node->children[node->num_children++] = child;
+  return 0;
+}
+
+// insert adds the remainder of a pattern below node
+static int insert(build_node* node, const char* pattern, const char* method, handler_fn fn)
+{
+  if (*pattern == '\0')
+  {
+    return add_method(node, method, fn);
+  }
+
+  if (*pattern == ':' || *pattern == '*')
+  {
+    bool wildcard = *pattern == '*';
+    size_t name_len = wildcard ? strlen(pattern + 1) : strcspn(pattern + 1, "/");
+    if (name_len == 0)
+    {
+      printf("route placeholder is missing a name\n");
+      return 1;
+    }
+    build_node** slot = wildcard ? &node->wildcard : &node->param;
+    if (*slot == NULL)
+    {
+      if ((*slot = new_build_node(NULL, 0)) == NULL)
+      {
+        return 1;
+      }
+      (*slot)->param_name = strndup(pattern + 1, name_len);
+    } else if (strlen((*slot)->param_name) != name_len || strncmp((*slot)->param_name, pattern + 1, name_len) != 0) {
+      printf("conflicting route placeholder names :%s and %.*s\n", (*slot)->param_name, (int)name_len + 1, pattern);
+      return 1;
+    }
+    return insert(*slot, pattern + 1 + name_len, method, fn);
+  }
+
+  // Literal text runs until the next placeholder
+  size_t literal_len = strcspn(pattern, ":*");
+  for (int i = 0; i < node->num_children; ++i)
+  {
+    build_node* child = node->children[i];
+    if (child->prefix[0] != pattern[0])
+    {
+      continue;
+    }
+    size_t common = 0;
+    while (common < literal_len && child->prefix[common] != '\0' && child->prefix[common] == pattern[common])
+    {
+      ++common;
+    }
+    if (child->prefix[common] != '\0')
+    {
+      // Split the edge: a new node takes the shared text, and child keeps the rest
+      build_node* split = new_build_node(child->prefix, common);
+      if (split == NULL || add_child(split, child) != 0)
+      {
+        return 1;
+      }
+      memmove(child->prefix, child->prefix + common, strlen(child->prefix + common) + 1);
+      node->children[i] = split;
+      child = split;
+    }
+    return insert(child, pattern + common, method, fn);
+  }
+
+  build_node* child = new_build_node(pattern, literal_len);
+  if (child == NULL || add_child(node, child) != 0)
+  {
+    return 1;
+  }
+  return insert(child, pattern + literal_len, method, fn);
+}
+
+int route_register(const char* method, const char* pattern, handler_fn fn)
+{
+  if (route_nodes != NULL)
+  {
+    printf("routes must be registered before routes_compile\n");
+    return 1;
+  }
+  if (pattern[0] != '/')
+  {
+    printf("route pattern %s must start with /\n", pattern);
+    return 1;
+  }
+  if (build_root == NULL && (build_root = new_build_node(NULL, 0)) == NULL)
+  {
+    return 1;
+  }
+  if (insert(build_root, pattern, method, fn) != 0)
+  {
+    printf("error registering route %s %s\n", method, pattern);
+    return 1;
+  }
+  return 0;
+}
+
+// add_string appends str to the string pool, returning its offset
+static uint32_t add_string(const char* str)
+{
+  size_t len = str == NULL ? 0 : strlen(str);
+  char* strings = (char*)realloc(route_strings, route_strings_len + len + 1);
+  if (strings == NULL)
+  {
+    perror("allocating route strings");
+    exit(1);
+  }
+  route_strings = strings;
+  uint32_t offset = route_strings_len;
+  memcpy(route_strings + offset, str == NULL ? "" : str, len);
+  route_strings[offset + len] = '\0';
+  route_strings_len += len + 1;
+  return offset;
+}
+
+static int count_nodes(build_node* node, int* num_methods)
+{
+  if (node == NULL)
+  {
+    return 0;
+  }
+  *num_methods += node->num_methods;
+  int count = 1 + count_nodes(node->param, num_methods) + count_nodes(node->wildcard, num_methods);
+  for (int i = 0; i < node->num_children; ++i)
+  {
+    count += count_nodes(node->children[i], num_methods);
+  }
+  return count;
+}
+
+static int compare_children(const void* a, const void* b)
+{
+  return (unsigned char)(*(build_node**)a)->prefix[0] - (unsigned char)(*(build_node**)b)->prefix[0];
+}
+
+// add_allow appends the methods of node to the string pool as an Allow header value, returning its offset
+static uint32_t add_allow(build_node* node)
+{
+  size_t len = 0;
+  for (int i = 0; i < node->num_methods; ++i)
+  {
+    len += strlen(node->methods[i].method) + 2;
+  }
+  char* allow = (char*)malloc(len + 1);
+  if (allow == NULL)
+  {
+    perror("allocating route strings");
+    exit(1);
+  }
+  allow[0] = '\0';
+  for (int i = 0; i < node->num_methods; ++i)
+  {
+    if (i > 0)
+    {
+      strcat(allow, ", ");
+    }
+    strcat(allow, node->methods[i].method);
+  }
+  uint32_t offset = add_string(allow);
+  free(allow);
+  return offset;
+}
+
+// flatten writes node into route_nodes[index], reserving slots for its children from *next_node onwards
+static void flatten(build_node* node, uint32_t index, uint32_t* next_node, uint32_t* next_method)
+{
+  route_node* out = &route_nodes[index];
+  out->prefix = add_string(node->prefix);
+  out->prefix_len = node->prefix == NULL ? 0 : strlen(node->prefix);
+  out->param_name = add_string(node->param_name);
+  out->first_method = *next_method;
+  out->num_methods = node->num_methods;
+  out->allow = add_allow(node);
+  memcpy(&route_methods[*next_method], node->methods, sizeof(route_method) * node->num_methods);
+  *next_method += node->num_methods;
+
+  qsort(node->children, node->num_children, sizeof(build_node*), compare_children);
+  out->first_child = *next_node;
+  out->num_children = node->num_children;
+  *next_node += node->num_children;
+  out->param = node->param == NULL ? -1 : (int32_t)(*next_node)++;
+  out->wildcard = node->wildcard == NULL ? -1 : (int32_t)(*next_node)++;
+
+  for (int i = 0; i < node->num_children; ++i)
+  {
+    flatten(node->children[i], out->first_child + i, next_node, next_method);
+  }
+  if (node->param != NULL)
+  {
+    flatten(node->param, out->param, next_node, next_method);
+  }
+  if (node->wildcard != NULL)
+  {
+    flatten(node->wildcard, out->wildcard, next_node, next_method);
+  }
+}
+
+// free_build_node frees node and its subtree. Method names now belong to route_methods
+static void free_build_node(build_node* node)
+{
+  if (node == NULL)
+  {
+    return;
+  }
+  for (int i = 0; i < node->num_children; ++i)
+  {
+    free_build_node(node->children[i]);
+  }
+  free_build_node(node->param);
+  free_build_node(node->wildcard);
+  free(node->children);
+  free(node->methods);
+  free(node->prefix);
+  free(node->param_name);
+  free(node);
+}
+
+int routes_compile(void)
+{
+  if (build_root == NULL && (build_root = new_build_node(NULL, 0)) == NULL)
+  {
+    return 1;
+  }
+  int num_methods = 0;
+  int num_nodes = count_nodes(build_root, &num_methods);
+  route_nodes = (route_node*)calloc(num_nodes, sizeof(route_node));
+  route_methods = (route_method*)calloc(num_methods > 0 ? num_methods : 1, sizeof(route_method));
+  if (route_nodes == NULL || route_methods == NULL)
+  {
+    perror("allocating compiled routes");
+    return 1;
+  }
+  uint32_t next_node = 1;
+  uint32_t next_method = 0;
+  flatten(build_root, 0, &next_node, &next_method);
+  free_build_node(build_root);
+  build_root = NULL;
+  printf("Compiled %d route(s) into %d trie node(s)\n", num_methods, num_nodes);
+  return 0;
+}
+
+// find_child binary searches the literal children of node for the one starting with c
+static const route_node* find_child(const route_node* node, char c)
+{
+  uint32_t lo = node->first_child;
+  uint32_t hi = node->first_child + node->num_children;
+  while (lo < hi)
+  {
+    uint32_t mid = lo + (hi - lo) / 2;
+    unsigned char first = route_strings[route_nodes[mid].prefix];
+    if (first == (unsigned char)c)
+    {
+      return &route_nodes[mid];
+    }
+    if (first < (unsigned char)c)
+    {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return NULL;
+}
+
+// match finds the node matching [path, end) below node (whose own edge has already been matched)
+static const route_node* match(const route_node* node, const char* path, const char* end, route_param* params, int* num_params)
+{
+  if (path == end && node->num_methods > 0)
+  {
+    return node;
+  }
+
+  if (path < end)
+  {
+    const route_node* child = find_child(node, *path);
+    if (child != NULL && (size_t)(end - path) >= child->prefix_len && memcmp(path, route_strings + child->prefix, child->prefix_len) == 0)
+    {
+      const route_node* found = match(child, path + child->prefix_len, end, params, num_params);
+      if (found != NULL)
+      {
+        return found;
+      }
+    }
+  }
+
+  if (*num_params >= ROUTE_MAX_PARAMS)
+  {
+    return NULL;
+  }
+  if (node->param != -1)
+  {
+    const char* segment_end = path;
+    while (segment_end < end && *segment_end != '/')
+    {
+      ++segment_end;
+    }
+    if (segment_end > path)
+    {
+      const route_node* param = &route_nodes[node->param];
+      route_param* captured = &params[(*num_params)++];
+      captured->name = route_strings + param->param_name;
+      captured->value = path;
+      captured->value_len = segment_end - path;
+      const route_node* found = match(param, segment_end, end, params, num_params);
+      if (found != NULL)
+      {
+        return found;
+      }
+      --*num_params;
+    }
+  }
+  if (node->wildcard != -1)
+  {
+    const route_node* wildcard = &route_nodes[node->wildcard];
+    route_param* captured = &params[(*num_params)++];
+    captured->name = route_strings + wildcard->param_name;
+    captured->value = path;
+    captured->value_len = end - path;
+    return wildcard;
+  }
+  return NULL;
+}
+
+int route_lookup(const char* method, const char* path, handler_fn* fn, route_param* params, int* num_params,
+  const char** allow)
+{
+  *num_params = 0;
+  if (route_nodes == NULL)
+  {
+    return 404;
+  }
+  const char* end = path + strcspn(path, "?");
+  const route_node* node = match(&route_nodes[0], path, end, params, num_params);
+  if (node == NULL)
+  {
+    return 404;
+  }
+  for (uint32_t i = 0; i < node->num_methods; ++i)
+  {
+    route_method* m = &route_methods[node->first_method + i];
+    if (strcmp(m->method, method) == 0)
+    {
+      *fn = m->fn;
+      return 0;
+    }
+  }
+  *allow = route_strings + node->allow;
+  return 405;
+}
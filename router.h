@@ -0,0 +1,36 @@
+#pragma once
+#include <stddef.h>
+
+// ROUTE_MAX_PARAMS is the maximum number of `:param` and `*wildcard` captures in a single route
+#define ROUTE_MAX_PARAMS 8
+
+typedef struct handler_ctx handler_ctx;
+
+// handler_fn is a dynamic request handler, see handler.h
+typedef int (*handler_fn)(handler_ctx* ctx);
+
+// route_param is a path segment captured by a `:name` or `*name` placeholder in a route pattern.
+// During lookup, value points into the request path and is not null-terminated: use value_len
+typedef struct {
+  const char* name;
+  const char* value;
+  size_t value_len;
+} route_param;
+
+// route_register adds a handler for method requests to paths matching pattern. Patterns are made up of:
+// - literal text, e.g. "/healthz"
+// - `:name`, matching a single non-empty path segment, e.g. "/users/:id"
+// - `*name` at the end of the pattern, matching the rest of the path, e.g. "/static/*file"
+// Literal text takes precedence over `:name`, which takes precedence over `*name`.
+// Routes must be registered before routes_compile is called. Returns 0 on success
+int route_register(const char* method, const char* pattern, handler_fn fn);
+
+// routes_compile freezes the registered routes into a compact radix trie used by route_lookup.
+// It is called once at startup, before the server forks any connections, so every connection shares the result
+int routes_compile(void);
+
+// route_lookup matches method and path (any query string is ignored) against the compiled routes.
+// It returns 0 and fills in fn and params if a route matches, 405 if the path matches but the method
+// doesn't (setting allow to the methods it does support, as an Allow header value), and 404 if nothing matches
+int route_lookup(const char* method, const char* path, handler_fn* fn, route_param* params, int* num_params,
+  const char** allow);
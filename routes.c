@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "request_handler.h"
+#include "handler.h"
+#include "routes.h"
+
+// MAX_SLEEP_MS caps the delay /api/sleep/:ms will honour
+#define MAX_SLEEP_MS 10000
+
+// started_at is when the routes were registered, i.e. roughly when this server generation started
+static long long started_at;
+
+static int healthz(handler_ctx* ctx)
+{
+  response_send(ctx, 200, "text/plain", "ok\n", 3);
+  return HANDLER_DONE;
+}
+
+static int api_status(handler_ctx* ctx)
+{
+  char body[128];
+  int len = snprintf(body, sizeof(body), "{\"pid\": %d, \"uptime_ms\": %lld}\n", getppid(), handler_now_ms() - started_at);
+  response_send(ctx, 200, "application/json", body, len);
+  return HANDLER_DONE;
+}
+
+static int api_sleep(handler_ctx* ctx)
+{
+  long* ms = HANDLER_STATE(ctx, long);
+  HANDLER_BEGIN(ctx);
+  *ms = strtol(handler_param(ctx, "ms"), NULL, 10);
+  if (*ms < 0 || *ms > MAX_SLEEP_MS)
+  {
+    const char* error = "{\"error\": \"ms out of range\"}\n";
+    response_send(ctx, 400, "application/json", error, strlen(error));
+    return HANDLER_DONE;
+  }
+  HANDLER_SLEEP(ctx, *ms);
+  response_begin(ctx, 200, "application/json");
+  response_printf(ctx, "{\"slept_ms\": %ld}\n", *ms);
+  HANDLER_END(ctx);
+}
+
+static int api_echo(handler_ctx* ctx)
+{
+  HANDLER_BEGIN(ctx);
+  response_begin(ctx, 200, "application/octet-stream");
+  while (1)
+  {
+    HANDLER_AWAIT_BODY(ctx);
+    if (ctx->body_done)
+    {
+      break;
+    }
+    response_write(ctx, ctx->body_chunk, ctx->body_chunk_len);
+    HANDLER_AWAIT_DRAINED(ctx);
+  }
+  HANDLER_END(ctx);
+}
+
+int register_builtin_routes(void)
+{
+  started_at = handler_now_ms();
+  if (route_register("GET", "/healthz", healthz) != 0 ||
+      route_register("GET", "/api/status", api_status) != 0 ||
+      route_register("GET", "/api/sleep/:ms", api_sleep) != 0 ||
+      route_register("POST", "/api/echo", api_echo) != 0)
+  {
+    return 1;
+  }
+  return 0;
+}
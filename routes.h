@@ -0,0 +1,8 @@
+#pragma once
+
+// register_builtin_routes registers the dynamic handlers that ship with the server:
+// - GET /healthz: liveness check
+// - GET /api/status: server process and uptime, as JSON
+// - GET /api/sleep/:ms: responds (as JSON) after ms milliseconds, without holding up anything else
+// - POST /api/echo: streams the request body back
+int register_builtin_routes(void);
@@ -0,0 +1,436 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "upgrade.h"
+
+/*
+  upgrade.c implements zero-downtime binary upgrades (and config reloads).
+
+  On SIGUSR2 (new binary) or SIGHUP (reload), the running server:
+  - creates a Unix socket pair and forks/execs argv[0], handing the child end of the pair over
+    via the UPGRADE_FD_ENV environment variable
+  - passes its listening socket to the new process over the pair using SCM_RIGHTS
+  - keeps accepting connections until the new process reports it is ready
+  - stops accepting, tells long-lived connections to wind down (by closing the write end of the drain pipe),
+    waits (up to DRAIN_TIMEOUT_SECS) for in-flight connections to finish, terminates any left over, and exits
+
+  Since both processes share the same listening socket, connections queued in the backlog are never dropped:
+  whichever process calls accept() next picks them up.
+*/
+
+volatile sig_atomic_t upgrade_requested = 0;
+
+int upgrade_signal_fd = -1;
+
+// upgrade_signal_writer is the (non-blocking) write end of the self-pipe behind upgrade_signal_fd
+static int upgrade_signal_writer = -1;
+
+int drain_fd = -1;
+
+// drain_writer is the write end of the drain pipe, held open by the accepting server only
+static int drain_writer = -1;
+
+// MAX_TRACKED_CONNECTIONS_INIT is the initial capacity of connections
+#define MAX_TRACKED_CONNECTIONS_INIT 64
+
+// DRAIN_POLL_INTERVAL_MS is how often drain_connections checks for finished connections
+#define DRAIN_POLL_INTERVAL_MS 100
+
+// connections holds the pids of the running connection processes (see connection_started)
+static pid_t* connections = NULL;
+static size_t num_connections = 0;
+static size_t connections_cap = 0;
+
+// predecessor_sock is the (inherited) Unix socket connecting us to the server we are replacing, if any
+static int predecessor_sock = -1;
+
+static void handle_upgrade_signal(int signum)
+{
+  int saved_errno = errno;
+  upgrade_requested = 1;
+  char byte = 0;
+  // If the pipe is full, a wakeup is already pending
+  write(upgrade_signal_writer, &byte, 1);
+  errno = saved_errno;
+}
+
+// handle_child_signal wakes the main loop through the self-pipe when a connection process exits, so it is reaped
+// right away rather than whenever the next connection or signal comes in
+static void handle_child_signal(int signum)
+{
+  int saved_errno = errno;
+  char byte = 0;
+  write(upgrade_signal_writer, &byte, 1);
+  errno = saved_errno;
+}
+
+int install_upgrade_handlers(void)
+{
+  int fds[2];
+  if (pipe(fds) == -1)
+  {
+    perror("error creating upgrade signal pipe");
+    return 1;
+  }
+  for (int i = 0; i < 2; ++i)
+  {
+    fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+  }
+  upgrade_signal_fd = fds[0];
+  upgrade_signal_writer = fds[1];
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handle_upgrade_signal;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART; // the main loop learns of the signal from upgrade_signal_fd
+  if (sigaction(SIGHUP, &sa, NULL) == -1 || sigaction(SIGUSR2, &sa, NULL) == -1)
+  {
+    perror("error installing upgrade signal handlers");
+    return 1;
+  }
+  sa.sa_handler = handle_child_signal;
+  sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+  if (sigaction(SIGCHLD, &sa, NULL) == -1)
+  {
+    perror("error installing SIGCHLD handler");
+    return 1;
+  }
+  return 0;
+}
+
+// send_fd passes fd over the Unix socket sock as SCM_RIGHTS ancillary data
+static int send_fd(int sock, int fd)
+{
+  char byte = 0;
+  struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  memset(&control, 0, sizeof(control));
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+  // MSG_NOSIGNAL: if the new server already died (e.g. exec failed) this must fail with EPIPE, not kill us with SIGPIPE
+  if (sendmsg(sock, &msg, MSG_NOSIGNAL) == -1)
+  {
+    perror("error sending listener over upgrade socket");
+    return -1;
+  }
+  return 0;
+}
+
+// recv_fd receives a single descriptor sent with send_fd over sock. Returns -1 on failure
+static int recv_fd(int sock)
+{
+  char byte;
+  struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+
+  ssize_t n;
+  while ((n = recvmsg(sock, &msg, 0)) == -1 && errno == EINTR);
+  if (n <= 0)
+  {
+    perror("error receiving listener over upgrade socket");
+    return -1;
+  }
+
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+  {
+    printf("upgrade socket message did not contain a descriptor\n");
+    return -1;
+  }
+  int fd;
+  memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+  return fd;
+}
+
+void clear_upgrade_signal(void)
+{
+  char buf[64];
+  while (read(upgrade_signal_fd, buf, sizeof(buf)) > 0);
+}
+
+int inherit_listener(void)
+{
+  char* env = getenv(UPGRADE_FD_ENV);
+  if (env == NULL)
+  {
+    return -1;
+  }
+  predecessor_sock = atoi(env);
+  unsetenv(UPGRADE_FD_ENV); // don't leak the setting into future upgrades
+  fcntl(predecessor_sock, F_SETFD, FD_CLOEXEC);
+
+  int server_fd = recv_fd(predecessor_sock);
+  if (server_fd == -1)
+  {
+    close(predecessor_sock);
+    predecessor_sock = -1;
+    return -1;
+  }
+  printf("Inherited listening socket from previous server generation\n");
+  return server_fd;
+}
+
+void announce_ready(void)
+{
+  if (predecessor_sock == -1)
+  {
+    return;
+  }
+  char ready = UPGRADE_READY;
+  if (write(predecessor_sock, &ready, 1) == -1)
+  {
+    perror("error notifying previous server generation");
+  }
+  close(predecessor_sock);
+  predecessor_sock = -1;
+}
+
+int begin_upgrade(char** argv, int server_fd)
+{
+  int pair[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == -1)
+  {
+    perror("error creating upgrade socket");
+    return -1;
+  }
+  // pair[0] stays with us; pair[1] is inherited by the new server across exec
+  fcntl(pair[0], F_SETFD, FD_CLOEXEC);
+
+  printf("\x1b[39;1mUpgrade requested: starting new server generation from %s\x1b[39m\n", argv[0]);
+  fflush(stdout);
+
+  // Double-fork so that the new server is not our child: draining waits for *all* our children,
+  // and the new server will outlive us
+  pid_t intermediate = fork();
+  if (intermediate == -1)
+  {
+    perror("error forking new server generation");
+    close(pair[0]);
+    close(pair[1]);
+    return -1;
+  }
+  if (intermediate == 0)
+  {
+    setsid();
+    pid_t server = fork();
+    if (server != 0)
+    {
+      _exit(server == -1 ? 1 : 0);
+    }
+    // The listener is passed over the socket rather than inherited, so that the exec'd binary
+    // gets it the same way regardless of how it was started
+    close(server_fd);
+    signal(SIGHUP, SIG_DFL);
+    signal(SIGUSR2, SIG_DFL);
+    char fd_str[16];
+    snprintf(fd_str, sizeof(fd_str), "%d", pair[1]);
+    setenv(UPGRADE_FD_ENV, fd_str, 1);
+    execvp(argv[0], argv);
+    perror("error executing new server binary");
+    _exit(1);
+  }
+  close(pair[1]);
+  while (waitpid(intermediate, NULL, 0) == -1 && errno == EINTR);
+
+  if (send_fd(pair[0], server_fd) == -1)
+  {
+    printf("New server generation failed to start, continuing to serve\n");
+    close(pair[0]);
+    return -1;
+  }
+  return pair[0];
+}
+
+int finish_upgrade(int upgrade_sock)
+{
+  char reply = 0;
+  ssize_t n;
+  while ((n = read(upgrade_sock, &reply, 1)) == -1 && errno == EINTR);
+  close(upgrade_sock);
+  if (n != 1 || reply != UPGRADE_READY)
+  {
+    printf("New server generation failed to start, continuing to serve\n");
+    return -1;
+  }
+  printf("New server generation is ready, draining connections\n");
+  return 0;
+}
+
+int open_drain_pipe(void)
+{
+  int fds[2];
+  if (pipe(fds) == -1)
+  {
+    perror("error creating drain pipe");
+    return 1;
+  }
+  // Neither end should survive into a new server generation
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+  drain_fd = fds[0];
+  drain_writer = fds[1];
+  return 0;
+}
+
+void close_drain_writer(void)
+{
+  if (drain_writer != -1)
+  {
+    close(drain_writer);
+    drain_writer = -1;
+  }
+}
+
+void connection_started(pid_t pid)
+{
+  if (num_connections == connections_cap)
+  {
+    size_t cap = connections_cap == 0 ? MAX_TRACKED_CONNECTIONS_INIT : connections_cap * 2;
+    pid_t* grown = (pid_t*)realloc(connections, cap * sizeof(pid_t));
+    if (grown == NULL)
+    {
+      // Untracked connections are still waited for when draining; they just can't be cut short
+      perror("error tracking connection process");
+      return;
+    }
+    connections = grown;
+    connections_cap = cap;
+  }
+  connections[num_connections++] = pid;
+}
+
+void connection_finished(pid_t pid)
+{
+  for (size_t i = 0; i < num_connections; ++i)
+  {
+    if (connections[i] == pid)
+    {
+      connections[i] = connections[--num_connections];
+      return;
+    }
+  }
+}
+
+void drain_connections(void)
+{
+  close_drain_writer();
+  int drained = 0;
+  bool terminated = false;
+  time_t deadline = time(NULL) + DRAIN_TIMEOUT_SECS;
+  while (1)
+  {
+    pid_t pid = waitpid(-1, NULL, terminated ? 0 : WNOHANG);
+    if (pid > 0)
+    {
+      connection_finished(pid);
+      ++drained;
+      continue;
+    }
+    if (pid == -1 && errno != EINTR)
+    {
+      break; // no children left
+    }
+    if (!terminated && time(NULL) >= deadline)
+    {
+      printf("Drain deadline passed, terminating %zu connection process(es)\n", num_connections);
+      for (size_t i = 0; i < num_connections; ++i)
+      {
+        kill(connections[i], SIGTERM);
+      }
+      terminated = true;
+      continue;
+    }
+    if (pid == 0)
+    {
+      poll(NULL, 0, DRAIN_POLL_INTERVAL_MS);
+    }
+  }
+  printf("Drained %d connection process(es), exiting\n", drained);
+}
+
+void warm_web_cache(const char* dir)
+{
+  DIR* d = opendir(dir);
+  if (d == NULL)
+  {
+    perror("error opening web directory for cache warming");
+    return;
+  }
+  int warmed = 0;
+  struct dirent* entry;
+  while ((entry = readdir(d)) != NULL)
+  {
+    if (entry->d_name[0] == '.')
+    {
+      continue;
+    }
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+    struct stat st;
+    if (stat(path, &st) == -1)
+    {
+      continue;
+    }
+    if (S_ISDIR(st.st_mode))
+    {
+      warm_web_cache(path);
+      continue;
+    }
+    if (!S_ISREG(st.st_mode))
+    {
+      continue;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+    {
+      continue;
+    }
+#ifdef POSIX_FADV_WILLNEED
+    posix_fadvise(fd, 0, st.st_size, POSIX_FADV_WILLNEED);
+#endif
+    close(fd);
+    ++warmed;
+  }
+  closedir(d);
+  printf("Warmed %d file(s) in %s\n", warmed, dir);
+}
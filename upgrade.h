@@ -0,0 +1,73 @@
+#pragma once
+#include <signal.h>
+#include <sys/types.h>
+
+// UPGRADE_FD_ENV names the environment variable used to tell a freshly exec'd server which
+// (inherited) Unix socket its predecessor will pass the listening socket over
+#define UPGRADE_FD_ENV "MYSERVER_UPGRADE_FD"
+
+// DRAIN_TIMEOUT_SECS bounds how long a draining server waits for its connections to finish on their own.
+// Connections still open after that (e.g. idle clients) are terminated with SIGTERM
+#define DRAIN_TIMEOUT_SECS 30
+
+// UPGRADE_READY is the single byte a new server writes back to its predecessor once it is
+// accepting connections on the inherited listener
+#define UPGRADE_READY 'R'
+
+// drain_fd is the read end of a pipe whose write end is held only by the accepting server process.
+// It reports EOF once that server starts draining, so long-lived connections (e.g. HTTP/2) can poll it and wind down.
+extern int drain_fd;
+
+// upgrade_requested is set by the SIGHUP/SIGUSR2 handler and polled by the main server loop
+extern volatile sig_atomic_t upgrade_requested;
+
+// upgrade_signal_fd becomes readable whenever the SIGHUP/SIGUSR2 or SIGCHLD handler runs (a self-pipe), so the main loop
+// can poll it alongside the listener: a signal arriving just before poll() would otherwise go unnoticed until the next connection
+extern int upgrade_signal_fd;
+
+// install_upgrade_handlers creates the self-pipe behind upgrade_signal_fd and registers the SIGHUP and SIGUSR2
+// handlers that request an upgrade, and the SIGCHLD handler that gets finished connection processes reaped
+int install_upgrade_handlers(void);
+
+// clear_upgrade_signal empties the self-pipe once the main loop has seen upgrade_signal_fd become readable
+void clear_upgrade_signal(void);
+
+// inherit_listener checks whether this process was exec'd by a running server as part of an upgrade.
+// If so, the listening socket is received over the upgrade socket and returned. Returns -1 if
+// this is a cold start (or the handoff failed), in which case the caller should bind its own socket.
+int inherit_listener(void);
+
+// announce_ready tells the predecessor server (if any) that we are accepting connections, and that
+// it may stop accepting and begin draining.
+void announce_ready(void);
+
+// begin_upgrade forks and execs a new instance of the server binary (argv[0]) and passes server_fd to it
+// using SCM_RIGHTS. The returned descriptor becomes readable once the new server is ready (or has died).
+// Returns -1 on failure, in which case the current server should simply keep serving.
+int begin_upgrade(char** argv, int server_fd);
+
+// finish_upgrade reads the new server's reply from upgrade_sock. It returns 0 if the new server
+// is ready and the caller should drain and exit, or -1 if the upgrade was aborted.
+int finish_upgrade(int upgrade_sock);
+
+// open_drain_pipe creates the pipe behind drain_fd. It must be called by the accepting server before forking any connections
+int open_drain_pipe(void);
+
+// close_drain_writer must be called by each forked connection process, so that only the accepting server holds
+// the write end of the drain pipe
+void close_drain_writer(void);
+
+// connection_started records a forked connection process, so that drain_connections can terminate it
+// if it outlives the drain deadline
+void connection_started(pid_t pid);
+
+// connection_finished forgets a connection process once it has been reaped
+void connection_finished(pid_t pid);
+
+// drain_connections signals long-lived connections to wind down (via drain_fd), then waits for all in-flight
+// connections (forked children) to finish, terminating any still running after DRAIN_TIMEOUT_SECS
+void drain_connections(void);
+
+// warm_web_cache pulls the metadata and contents of every file in dir into the OS caches, so that
+// the first requests served after an upgrade don't pay for cold reads.
+void warm_web_cache(const char* dir);